@@ -13,6 +13,8 @@ History: ..DEC.02; Henk B&B; For ELMBfw (framework), originally derived from
 			       - max bus-off counter
 	 ..NOV.04; Henk B&B; ELMBfw v2.1:
 	                     - Support for Segmented SDO, with example.
+	 16OCT.26; agent; Added BAUD800K and BAUD1000K (not selectable
+			  by jumper).
 --------------------------------------------------------------------------- */
 
 #ifndef CONF1XX_H
@@ -242,5 +244,9 @@ History: ..DEC.02; Henk B&B; For ELMBfw (framework), originally derived from
 #define BAUD250K                        0x02
 #define BAUD125K                        0x03
 
+/* Bit rates that can only be selected by a CAN configuration parameter */
+#define BAUD800K                        0x04
+#define BAUD1000K                       0x05
+
 #endif /* CONF1XX_H */
 /* ------------------------------------------------------------------------ */
@@ -7,6 +7,7 @@ Descr  : Include file containing constants concerning the
 History: 19JAN.00; Henk B&B; First version.
          20SEP.00; Henk B&B; Left application-specific stuff in 'can.h'
 	                     and renamed this part '81c91.h'.
+	 16OCT.26; agent; Added 800 kbit/s and 1 Mbit/s settings.
 --------------------------------------------------------------------------- */
 
 #ifndef SAE81C91_H
@@ -130,6 +131,20 @@ History: 19JAN.00; Henk B&B; First version.
 #define C91_BL1_500K                    0x23
 #define C91_BL2_500K                    0x41
 
+/* At BRP=0 the time quantum is 250 ns, so at the higher bit rates
+   there are only a few per bit: SJW=0 and little room for clock
+   tolerance, i.e. for short buses only */
+
+/*  800 kbit/s: BRP=0, TS1=2, TS2=0, SJW=0 (5 tq, sample point 80%) */
+#define C91_BRP_800K                    0x00
+#define C91_BL1_800K                    0x02
+#define C91_BL2_800K                    0x40
+
+/* 1000 kbit/s: BRP=0, TS1=1, TS2=0, SJW=0 (4 tq, sample point 75%) */
+#define C91_BRP_1000K                   0x00
+#define C91_BL1_1000K                   0x01
+#define C91_BL2_1000K                   0x40
+
 #endif /* __ELMB_TIMINGS__ */
 
 #ifdef __CIA_TIMINGS__
@@ -157,6 +172,11 @@ History: 19JAN.00; Henk B&B; First version.
 #define C91_BL1_500K                    0x05
 #define C91_BL2_500K                    0x40
 
+/*  800 kbit/s: BRP=0, TS1= 2, TS2=0, SJW=0 */
+#define C91_BRP_800K                    0x00
+#define C91_BL1_800K                    0x02
+#define C91_BL2_800K                    0x40
+
 /* 1000 kbit/s: BRP=0, TS1= 1, TS2=0, SJW=0 */
 #define C91_BRP_1000K                   0x00
 #define C91_BL1_1000K                   0x01
@@ -10,6 +10,10 @@ History: 26DEC.02; Henk B&B; Framework, based on ELMBio application (v4.1).
 			     always do 'periodic jobs' even when a CAN-message
 			     is handled, to prevent message-handling to take
 			     all processor time.
+	 16OCT.26; agent; Start the free-running Timer3 timebase;
+			  optional main-loop iteration-time profiling
+			  (compile option _LOOP_PROFILE_).
+	 16OCT.26; agent; Refresh the SPI Control Register, if used.
 --------------------------------------------------------------------------- */
 
 #include "general.h"
@@ -18,9 +22,11 @@ History: 26DEC.02; Henk B&B; Framework, based on ELMBio application (v4.1).
 #include "crc.h"
 #include "eeprom.h"
 #include "guarding.h"
+#include "looptime.h"
 #include "objects.h"
 #include "pdo.h"
 #include "sdo.h"
+#include "spi.h"
 #include "store.h"
 #include "timer1XX.h"
 #include "watchdog.h"
@@ -93,6 +99,11 @@ void main( void )
      Life Guarding, Timer-triggered PDO transmissions, etc. */
   timer1_init();
 
+#ifndef _ELMB103_
+  /* Initialize Timer3 as a free-running timebase for time measurements */
+  timer3_init();
+#endif /* _ELMB103_ */
+
   WDR(); /* In case of a free-running watchdog timer */
 
   /* Check the CRC added to the code in FLASH, if present */
@@ -150,13 +161,26 @@ void main( void )
      (possibly making life simpler for a host application?) */
   NodeState = canopen_init_state();
 
+#ifdef _LOOP_PROFILE_
+  /* Start main-loop iteration-time profiling */
+  looptime_init();
+#endif /* _LOOP_PROFILE_ */
+
   /* Application loop */
   while(1)
     {
+#ifdef _LOOP_PROFILE_
+      /* Account for the time spent in the previous iteration */
+      looptime_next();
+#endif /* _LOOP_PROFILE_ */
+
       /* Refresh some registers, to be more rad-tolerant... */
       CAN_INT_DISABLE();
       DDRB  = PORTB_DDR_OPERATIONAL;
       PORTB = PORTB_DATA_OPERATIONAL;
+#ifdef _HW_SPI_
+      SPCR  = SPI_SPCR_SETTING;
+#endif /* _HW_SPI_ */
       CAN_INT_ENABLE();
 
       /* Do the watchdog function */
@@ -217,6 +241,11 @@ void main( void )
 	 DLC and (a pointer to) the data bytes (if any) from the buffer */
       object_no = can_read( &dlc, &can_data );
 
+#ifdef _LOOP_PROFILE_
+      /* Remember the message handled in this iteration */
+      looptime_object( object_no );
+#endif /* _LOOP_PROFILE_ */
+
       /* Reset the Life Guarding time-out counter (a message was received)
 	 but should actually be done through Node Guarding only...
 	 (according to CANopen standard) */
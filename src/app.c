@@ -23,6 +23,10 @@ Descr  : User application functions.
 
 
 History: ..JAN.03; username; Definition.
+	 16OCT.26; agent; Scan: postpone a TPDO only when its transmit
+			  queue is full.
+	 16OCT.26; agent; Added APP_RPDO_FAST[] and an example RPDO
+			  'fast' handler (_RPDO_FAST_).
 --------------------------------------------------------------------------- */
 
 #include "general.h"
@@ -58,6 +62,26 @@ const UINT32 PDOMAP[TPDO_CNT+RPDO_CNT][APP_MAX_MAPPED_CNT] =
   { 0x62000108L, 0x62000208L }  /* example: Digital Outputs: 1-8, 9-16 */
 };
 
+#ifdef _RPDO_FAST_
+/* Per RPDO a 'fast' handler function, called directly from the CAN INT
+   interrupt routine instead of app_rpdoN() from the main loop,
+   or 0 (RPDO handled by app_rpdoN() as usual);
+   such a function:
+   - runs with interrupts disabled, at most CAN_INT_BUDGET of them
+     per interrupt: keep it short (say, below 50 us: a few port writes)
+   - must not access EEPROM, the ADC or the CAN-controller (so no
+     can_write()), must not use timer2 delays and must not enable
+     interrupts
+   - is only called in state Operational
+   (e.g. { app_rpdo1_fast, 0, 0, 0 } to have RPDO1 handled by
+    app_rpdo1_fast() instead of app_rpdo1()) */
+/* ...fill in.... */
+const RPDO_FAST_FUNC APP_RPDO_FAST[RPDO_CNT] =
+{
+  0, 0, 0, 0
+};
+#endif /* _RPDO_FAST_ */
+
 /* Application parameter example: total number of channels */
 static BYTE AppChans;     /* (copy in EEPROM) */
 
@@ -139,6 +163,21 @@ void app_rpdo1( BYTE dlc, BYTE *can_data )
 
 /* ------------------------------------------------------------------------ */
 
+#ifdef _RPDO_FAST_
+void app_rpdo1_fast( BYTE dlc, BYTE *can_data )
+{
+  /* Receive-PDO received containing 'dlc' databytes in 'can_data[]':
+     called from the CAN INT interrupt routine, if registered
+     in APP_RPDO_FAST[] (an example: not registered by default):
+     - write data from 'can_data[]' to your hardware, quickly!
+     - no reply message required */
+
+  /* ...fill in.... */
+}
+
+/* ------------------------------------------------------------------------ */
+#endif /* _RPDO_FAST_ */
+
 void app_rpdo2( BYTE dlc, BYTE *can_data )
 {
   /* Receive-PDO received containing 'dlc' databytes in 'can_data[]':
@@ -323,10 +362,6 @@ static BOOL app_scan_next( void )
 
   /* Send a TPDO with the next channel's data, if available */
 
-  /* Postpone sending if necessary !
-     (when previous message has not been sent yet) */
-  if( can_transmitting(C91_TPDO1) ) return TRUE;
-
   /* Put the channel number in one of the PDO databytes */
   pdo_data[0] = AppChanNo;
 
@@ -336,8 +371,12 @@ static BOOL app_scan_next( void )
     for( i=1; i<C91_TPDO1_LEN; ++i ) pdo_data[i] = i+0x10;
   }
 
-  /* Send a Transmit-PDO (TPDO1 chosen as an example) */
-  can_write( C91_TPDO1, C91_TPDO1_LEN, pdo_data );
+  /* Send a Transmit-PDO (TPDO1 chosen as an example);
+     postpone sending if necessary !
+     (when the transmit queue is full: try again next time;
+      check first, so that it is not counted as a dropped message) */
+  if( can_txq_full( C91_TPDO1 ) ) return TRUE;
+  if( can_write( C91_TPDO1, C91_TPDO1_LEN, pdo_data ) == FALSE ) return TRUE;
 
   ++AppChanNo;
   /* Are we done with the current scan cycle?,
@@ -4,6 +4,7 @@ File   : app.h
 Descr  : Definitions and declarations of user application functions.
 
 History: ..JAN.03; username; Definition.
+	 16OCT.26; agent; Added app_rpdo1_fast() (_RPDO_FAST_).
 --------------------------------------------------------------------------- */
 
 #ifndef APP_H
@@ -33,6 +34,9 @@ void app_rpdo1          ( BYTE dlc, BYTE *can_data );
 void app_rpdo2          ( BYTE dlc, BYTE *can_data );
 void app_rpdo3          ( BYTE dlc, BYTE *can_data );
 void app_rpdo4          ( BYTE dlc, BYTE *can_data );
+#ifdef _RPDO_FAST_
+void app_rpdo1_fast     ( BYTE dlc, BYTE *can_data );
+#endif /* _RPDO_FAST_ */
 
 void app_tpdo_on_cos    ( void );
 void app_tpdo_scan_start( void );
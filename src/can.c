@@ -34,16 +34,79 @@ History: 19JAN.00; Henk B&B; Definition.
 			     initialize Emergency toggle bit globally, once,
 			     not in can_init(), to prevent bit not toggling;
 			     init error counter only when all is initialized.
+	 16OCT.26; agent; Optionally count CAN-controller register reads,
+			  writes and SPI clocks per call site
+			  (compile option _SPI_STATS_).
+	 16OCT.26; agent; Optionally keep receive interrupt and message
+			  buffer statistics (compile option _CAN_STATS_).
+	 16OCT.26; agent; Optionally keep per-buffer frame counters,
+			  error interrupt counters and the node's traffic
+			  share (compile option _CAN_TRAFFIC_).
+	 16OCT.26; agent; Optional hardware SPI: switch it off while
+			  reading the jumpers (PB0 is the SPI's SS pin).
+	 16OCT.26; agent; Added can_read_burst() and can_write_burst():
+			  multiple registers in a single SPI transaction
+			  (address auto-increment); used for message
+			  data bytes and descriptor pairs.
+	 16OCT.26; agent; Separate priority buffer 'lane' for NMT, SYNC
+			  and RTR messages, handled before the messages
+			  in the (bulk) lane with SDO and PDO messages.
+	 16OCT.26; agent; Message buffer lanes are now rings with an
+			  input index, written only by the interrupt
+			  routine, and an output index, written only by
+			  the main loop (both still triple-voted), so
+			  can_msg_available() and can_read() no longer
+			  need to disable the CAN INT interrupt.
+	 16OCT.26; agent; Use the protected-byte functions (protbyte.c)
+			  for the message buffer indices.
+	 16OCT.26; agent; Software transmit queues per transmit buffer,
+			  refilled under the 81c91's Transmit
+			  interrupt: can_write() no longer waits or
+			  overwrites a pending message; NodeGuard
+			  descriptor update deferred instead of
+			  waiting for the Bootup message to be sent.
+	 16OCT.26; agent; Non-blocking Bus-off recovery (Timer0 time-out
+			  instead of a 100 ms busy-wait), with optional
+			  exponential back-off.
+	 16OCT.26; agent; Optionally handle selected RPDOs directly
+			  in the CAN INT interrupt (compile option
+			  _RPDO_FAST_).
+	 16OCT.26; agent; Keep at most one SYNC in the receive buffer;
+			  count the SYNCs dropped, with optional
+			  Emergency above a threshold.
+	 16OCT.26; agent; Added 800 kbit/s and 1 Mbit/s; a bit rate in
+			  the CAN configuration parameters may overrule
+			  the jumpers.
+	 16OCT.26; agent; Optional automatic baudrate detection at
+			  initialisation (compile option _CAN_AUTOBAUD_).
+	 16OCT.26; agent; can_check_for_msgs(): select the pending buffer
+			  by (configurable) priority class, using a
+			  lookup table; read the Receive-Ready registers
+			  only when no known message is left.
+	 16OCT.26; agent; _CAN_REFRESH_: instead of refreshing descriptors
+			  in can_write() (and not in can_read(): disabled
+			  on purpose, __CAN_REFRESH__, a message may get
+			  lost) refresh the descriptors and some
+			  configuration registers one step at a time,
+			  at a fixed (slow) rate, from
+			  can_check_for_errors().
+	 16OCT.26; agent; Received messages are always timestamped
+			  (Timer3, not on the ATmega103): added
+			  can_read_timestamp() and can_sync_timestamp();
+			  handling-latency statistics per message type.
 --------------------------------------------------------------------------- */
 
 #include "general.h"
 #include "can.h"
 #include "guarding.h"
 #include "jumpers.h"
+#include "objects.h"
 #include "pdo.h"
+#include "protbyte.h"
 #include "spi.h"
 #include "store.h"
 #include "timer1XX.h"
+#include "watchdog.h"
 
 #ifdef _VARS_IN_EEPROM_
 #include "eeprom.h"
@@ -55,17 +118,31 @@ extern BYTE NodeState;
 /* ------------------------------------------------------------------------ */
 /* CAN message buffering in RAM */
 
-/* Number of message buffers (here must be a power of 2!) */
+/* Received messages are stored in one of two buffer 'lanes':
+   a small lane for the time-critical NMT, SYNC and RTR messages,
+   which are handled first, and a lane for all other messages */
+#define CAN_LANE_PRIO   0
+#define CAN_LANE_BULK   1
+#define CAN_LANES       2
+
+/* Number of message buffers per lane (here must be a power of 2!) */
+#define CAN_PRIO_BUFS   8
 #define CAN_BUFS        64
-#define CAN_BUFS_MASK   CAN_BUFS-1
 /* Size of message buffer */
+#ifdef _ELMB103_
 #define CAN_BUF_SIZE    11
+#else
+#define CAN_BUF_SIZE    13
+#endif /* _ELMB103_ */
 
 /* Indices into the individual buffers */
 #define MSG_DATA_I      0
 #define MSG_DLC_I       8
 #define MSG_OBJECT_I    9
 #define MSG_VALID_I     10
+#ifndef _ELMB103_
+#define MSG_TSTAMP_I    11  /* Timer3 value at reception (2 bytes) */
+#endif /* _ELMB103_ */
 
 /* Buffer values:
    'message-present' byte in location MSG_VALID_I:
@@ -76,20 +153,99 @@ extern BYTE NodeState;
 #define BUF_EMPTY       0xFF
 #define BUF_NOT_EMPTY   0x00
 
-/* Array of CAN message buffers */
+/* Arrays of CAN message buffers */
+static BYTE CanPrioMsgBuf[CAN_PRIO_BUFS][CAN_BUF_SIZE];
 static BYTE CanMsgBuf[CAN_BUFS][CAN_BUF_SIZE];
 
+/* Number of message buffers in each lane */
+const BYTE CAN_LANE_BUFS[CAN_LANES] = { CAN_PRIO_BUFS, CAN_BUFS };
+
+/* Maximum number of messages copied to the buffer per CAN INT interrupt
+   (may be overruled in the compiler options) */
+#ifndef CAN_INT_BUDGET
+#define CAN_INT_BUDGET  8
+#endif
+
 static BOOL CanBufFull;
 
-/* Parameters which are being used according to a majority voting mechanism:
-   MsgOutIndex_ : index of the first-to-be-handled CAN-message buffer,
-   MsgCounter_: number of unhandled CAN-messages in buffers */
-static BYTE MsgOutIndex1, MsgOutIndex2, MsgOutIndex3;
-static BYTE MsgCounter1,  MsgCounter2,  MsgCounter3;
+#ifndef _ELMB103_
+/* Time of reception (Timer3) of the message last returned by can_read()
+   and of the last SYNC message returned */
+static UINT16 CanReadTstamp;
+static UINT16 CanSyncTstamp;
+#endif /* _ELMB103_ */
+
+/* Parameters which are being used according to a majority voting mechanism
+   (protected bytes, see protbyte.c; one set per lane):
+   MsgInIndex : index of the first empty CAN-message buffer,
+                written only by the CAN INT interrupt routine
+   MsgOutIndex: index of the first-to-be-handled CAN-message buffer,
+                written only by the main loop;
+   the number of unhandled CAN-messages in a lane is the difference;
+   each side votes (and corrects) its own index, and only reads
+   (votes on, without correcting) the other side's index, so no
+   interrupt disabling is needed: while the 3 copies of an index are
+   being updated the vote results in either the old or the new value */
+static PROT_BYTE MsgInIndex[CAN_LANES];
+static PROT_BYTE MsgOutIndex[CAN_LANES];
 
 /* NB: make sure to disable the CAN INT interrupt before writing or reading
-   anything to/from the CAN-controller in the main program loop !
-   (and also when updating the buffer counter in the main loop) */
+   anything to/from the CAN-controller in the main program loop ! */
+
+/* ------------------------------------------------------------------------ */
+/* CAN message transmit queues in RAM */
+
+/* A message for a transmit buffer that is still busy sending the previous
+   one is put in that buffer's queue; the CAN INT interrupt routine
+   (Transmit interrupt) loads it into the buffer when the buffer is free */
+
+/* Number of transmit queues (one per transmit buffer) */
+#define CAN_TXQS        7
+
+/* Number of messages per queue (here must be a power of 2!)
+   (may be overruled in the compiler options) */
+#ifndef CAN_TXQ_DEPTH
+#define CAN_TXQ_DEPTH   4
+#endif
+
+/* Queue entry: data bytes and length */
+#define CAN_TXQ_SIZE    9
+#define TXQ_LEN_I       8
+
+/* No queue for this buffer (receive buffer) */
+#define NO_TXQ          0xFF
+
+/* Queue number for each message buffer */
+const BYTE CAN_TXQ_NO[C91_MSG_BUFFERS] =
+{
+  NO_TXQ, NO_TXQ, NO_TXQ, 0,      /* Buffer 3: Emergency         */
+  1,      NO_TXQ, 2,      3,      /* 4: SDO-tx, 6: NodeGuard, 7: TPDO1 */
+  4,      5,      6,      NO_TXQ, /* 8-10: TPDO2-4               */
+  NO_TXQ, NO_TXQ, NO_TXQ, NO_TXQ
+};
+
+/* Message buffer for each queue */
+const BYTE CAN_TXQ_OBJECT[CAN_TXQS] =
+{
+  C91_EMERGENCY, C91_SDOTX, C91_NODEGUARD,
+  C91_TPDO1, C91_TPDO2, C91_TPDO3, C91_TPDO4
+};
+
+static BYTE CanTxQ[CAN_TXQS][CAN_TXQ_DEPTH][CAN_TXQ_SIZE];
+static BYTE CanTxQOut[CAN_TXQS];   /* Index of the next message to send  */
+static BYTE CanTxQCnt[CAN_TXQS];   /* Number of messages in the queue    */
+static BYTE CanTxQueued;           /* Total number of queued messages    */
+
+/* NodeGuard descriptor waiting for the Bootup/NodeGuard buffer
+   to become free (see can_rtr_enable()) */
+static BOOL CanNgDescPending;
+static BYTE CanNgDesc;
+
+/* Current setting of the CAN-controller's Interrupt Mask register */
+static BYTE CanIntMask;
+
+/* NB: the queues are accessed with the CAN INT interrupt disabled
+   in the main loop */
 
 /* ------------------------------------------------------------------------ */
 /* CAN-controller message object descriptors */
@@ -155,31 +311,105 @@ const BYTE CAN_DESCRIPTOR[C91_MSG_BUFFERS][2] =
   { 0xFF,		0xE0 }
 };
 
-/* This array of BOOLs indicates which CAN-controller buffers
-   are receiving buffers; their descriptors are refreshed
-   (if __CAN_REFRESH__ is defined in can_read() and can_write()).
-   Make sure this array matches CAN_DESCRIPTOR[] !
-   Do not refresh RTR buffer like this: RTR may get lost */
-const BOOL CANBUF_IS_RECV[C91_MSG_BUFFERS] =
-{
-  FALSE, TRUE,  TRUE,  FALSE,
-  FALSE, TRUE,  FALSE, FALSE,
-  FALSE, FALSE, FALSE, TRUE,
-  TRUE,  TRUE,  TRUE,  FALSE
-};
+#ifdef _CAN_REFRESH_
+/* Refresh ('scrub') of the CAN-controller's descriptor registers and
+   configuration registers, independent of the CAN traffic:
+   one step every CAN_REFRESH_INTERVAL_10MS x 10 ms (in the main loop),
+   one descriptor per step followed by a step for the configuration
+   registers (CAN_REFRESH_STEPS in total), so a round takes at most
+   CAN_REFRESH_STEPS x (10 ms x interval + main-loop iteration time)
+   (with the default interval about 1.7 s);
+   a descriptor that can't be rewritten safely at its step (a transmit
+   buffer in use, a receive buffer holding a message not yet read)
+   is skipped until the next round: so there is no guaranteed maximum
+   time until a particular descriptor is refreshed (a buffer that is
+   in use at its step each round is never refreshed); the RTR buffer's
+   descriptor is not refreshed at all: in Monitor Mode it holds the
+   identifier of the last received RTR, which may still have to be read;
+   NB: a message arriving while its receive buffer's descriptor is
+   being rewritten might get lost, so don't refresh too often
+   (may be overruled in the compiler options, but use at least 2:
+   a 1-tick Timer0 time-out may expire immediately) */
+#ifndef CAN_REFRESH_INTERVAL_10MS
+#define CAN_REFRESH_INTERVAL_10MS 10
+#endif
+#define CAN_REFRESH_STEPS        (C91_MSG_BUFFERS+1)
 
-/* Index for CANBUF_IS_RECV[] */
+/* Next refresh step */
 static BYTE CanRefreshIndex;
 
-/* CAN-controller register settings for baudrate configuration */
-const BYTE CAN_BAUDRATE_CONFIGS[4][3] =
+/* The bit timing registers as read back after initialisation
+   (compared with these rather than with the values written:
+   not all bits are necessarily read back as written) */
+static BYTE CanBitTiming[3];
+#endif /* _CAN_REFRESH_ */
+
+/* Whether RTRs are received by the microcontroller (Monitor Mode) or
+   NodeGuard RTRs are replied to automatically (see can_rtr_enable()) */
+static BOOL CanRtrEnabled;
+
+/* Number of baudrate configurations (the first 4 selectable by jumper) */
+#define CAN_BAUDRATES   6
+
+/* CAN-controller register settings for baudrate configuration
+   (index: BAUD50K, BAUD500K, etc.) */
+const BYTE CAN_BAUDRATE_CONFIGS[CAN_BAUDRATES][3] =
 {
   { C91_BRP_50K,	C91_BL1_50K,	C91_BL2_50K },
   { C91_BRP_500K,	C91_BL1_500K,	C91_BL2_500K },
   { C91_BRP_250K,	C91_BL1_250K,	C91_BL2_250K },
-  { C91_BRP_125K,	C91_BL1_125K,	C91_BL2_125K }
+  { C91_BRP_125K,	C91_BL1_125K,	C91_BL2_125K },
+  { C91_BRP_800K,	C91_BL1_800K,	C91_BL2_800K },
+  { C91_BRP_1000K,	C91_BL1_1000K,	C91_BL2_1000K }
+};
+
+/* Bit rates (in kbit/s) corresponding to the configurations above */
+const UINT16 CAN_BITRATE_KBPS[CAN_BAUDRATES] =
+{
+  50, 500, 250, 125, 800, 1000
 };
 
+/* Baudrate configuration from the CAN configuration parameters,
+   used instead of the jumper setting (or CAN_BAUDRATE_JUMPERS,
+   or CAN_BAUDRATE_AUTO: detect it, see can_autobaud()) */
+#define CAN_BAUDRATE_JUMPERS 0xFF
+#define CAN_BAUDRATE_AUTO    0xFE
+static BYTE CanBaudrateSel;     /* (copy in EEPROM) */
+
+/* How the baudrate in use was selected */
+static BYTE CanBaudrateSrc;
+
+#ifdef _CAN_AUTOBAUD_
+/* Automatic baudrate detection: listen (without acknowledging or sending
+   error frames) at each baudrate in turn, starting with the jumper
+   setting, for at most CAN_AUTOBAUD_WINDOW_10MS x 10 ms, until
+   CAN_AUTOBAUD_FRAMES frames have been received without reaching the
+   receive error warning level; give up after CAN_AUTOBAUD_CYCLES
+   rounds (so it takes at most CAN_BAUDRATES x CAN_AUTOBAUD_CYCLES x
+   CAN_AUTOBAUD_WINDOW_10MS x 10 ms: 3.6 s with the values below);
+   NB: the bus must carry traffic, acknowledged by another node
+   (may be overruled in the compiler options) */
+#ifndef CAN_AUTOBAUD_WINDOW_10MS
+#define CAN_AUTOBAUD_WINDOW_10MS 20
+#endif
+#ifndef CAN_AUTOBAUD_FRAMES
+#define CAN_AUTOBAUD_FRAMES      2
+#endif
+#ifndef CAN_AUTOBAUD_CYCLES
+#define CAN_AUTOBAUD_CYCLES      3
+#endif
+
+/* Detected baudrate (kept until the next reset), or CAN_BAUDRATE_UNKNOWN */
+#define CAN_BAUDRATE_UNKNOWN     0xFF
+static BYTE CanBaudrateAuto = CAN_BAUDRATE_UNKNOWN;
+
+/* Whether detection has been done (successful or not) since the reset */
+static BOOL CanAutobaudTried = FALSE;
+#endif /* _CAN_AUTOBAUD_ */
+
+/* Baudrate configuration in use (index into the arrays above) */
+static BYTE CanBaudrate;
+
 /* ------------------------------------------------------------------------ */
 /* Globals */
 
@@ -201,30 +431,253 @@ static BYTE CanBusOffMaxCnt;    /* (copy in EEPROM) */
 /* Bus-off events counter */
 BYTE        CanBusOffCnt = 0;
 
+/* Bus-off recovery back-off: the time before regaining bus access is
+   CAN_BUSOFF_WAIT_10MS (x 10 ms), doubled for every Bus-off event in
+   a series (CanBusOffSeries) beyond the first, but at most
+   CanBusOffBackoff times (0 = fixed back-off time); a series ends after
+   CAN_BUSOFF_QUIET_SECS seconds on the bus without a Bus-off
+   (CanBusOffCnt can't be used for this: it decays by one every second,
+   also while waiting); with back-off enabled the number of Bus-offs
+   in a series is also limited by CanBusOffMaxCnt */
+#define CAN_BUSOFF_WAIT_10MS   10
+#define CAN_BUSOFF_BACKOFF_MAX 7
+#define CAN_BUSOFF_QUIET_SECS  30
+static BYTE CanBusOffBackoff;   /* (copy in EEPROM) */
+static BYTE CanBusOffSeries;    /* Bus-off events in the current series */
+BYTE        CanBusOffQuiet = 0; /* Seconds to go until the series ends
+				   (decremented in timer1.c) */
+
+/* Bus-off recovery state */
+#define CAN_BUSOFF_IDLE        0
+#define CAN_BUSOFF_WAITING     1
+static BYTE   CanBusOffState = CAN_BUSOFF_IDLE;
+static UINT16 CanBusOffWait;    /* Back-off time still to go (x 10 ms)  */
+static BYTE   CanBusOffInts;    /* Interrupt and status register values */
+static BYTE   CanBusOffStatus;  /* at Bus-off, for the Emergency report */
+
+/* SYNC coalescing: at most one SYNC message is kept in the buffer,
+   a SYNC received while the previous one has not been handled yet
+   is dropped (and counted), so that a main loop that falls behind
+   sends its TPDOs once instead of once for every stale SYNC */
+static BOOL   CanSyncPending;       /* A SYNC is in the priority lane  */
+static UINT16 CanSyncDroppedCnt;    /* Number of SYNCs dropped         */
+static UINT16 CanSyncReportedCnt;   /* ..at the last Emergency report  */
+#ifndef _ELMB103_
+static BYTE   CanSyncIndex;         /* Buffer holding the pending SYNC */
+#endif /* _ELMB103_ */
+
+#ifdef _RPDO_FAST_
+/* NMT messages buffered but not yet handled by the main loop: while there
+   are any, RPDOs are not handled in the interrupt routine (NodeState may
+   be about to change) but buffered behind them; counted in by
+   can_buffer_msg() and out once the main loop is done with the NMT
+   message (at its next can_msg_available() or can_read() call),
+   each counter is written on one side only */
+static BYTE   CanNmtInCnt;
+static BYTE   CanNmtOutCnt;
+static BOOL   CanNmtRead;           /* can_read() returned an NMT      */
+#endif /* _RPDO_FAST_ */
+
+/* An Emergency is sent when more than this number of SYNCs has been
+   dropped since the previous report (0 = no Emergency) */
+static BYTE   CanSyncEmgThreshold;  /* (copy in EEPROM) */
+
 /* Help variables for RTR reception */
 static BYTE RtrIdHi;     /* (stored in EEPROM) */
 static BYTE RtrIdLo;     /* (stored in EEPROM) */
 
-/* Help variables for CAN message reception */
+/* Help variables for CAN message reception
+   (buffers 0-7 and 8-15 with a message still to be handled) */
 static BYTE ObjectMask1;
 static BYTE ObjectMask2;
 
+/* Bits for a buffer in the Receive-Ready registers 1 and 2 */
+#define RR1_BIT(b) ((b) <  C91_MSG_BUFFERS_PER_RRR ? (1 << ((b) & 7)) : 0)
+#define RR2_BIT(b) ((b) >= C91_MSG_BUFFERS_PER_RRR ? (1 << ((b) & 7)) : 0)
+
+/* Order in which buffers with a received message are handled:
+   per priority class the buffers (bits in Receive-Ready register 1 and 2);
+   within a class the lowest buffer number goes first */
+#define CAN_RECV_PRIOS  6
+const BYTE CAN_RECV_PRIO_MASK[CAN_RECV_PRIOS][2] =
+{
+  { RR1_BIT(C91_NMT),   RR2_BIT(C91_NMT)   },
+  { RR1_BIT(C91_SYNC),  RR2_BIT(C91_SYNC)  },
+  { RR1_BIT(C91_RTR),   RR2_BIT(C91_RTR)   },
+  { RR1_BIT(C91_RPDO1) | RR1_BIT(C91_RPDO2) |
+    RR1_BIT(C91_RPDO3) | RR1_BIT(C91_RPDO4),
+    RR2_BIT(C91_RPDO1) | RR2_BIT(C91_RPDO2) |
+    RR2_BIT(C91_RPDO3) | RR2_BIT(C91_RPDO4) },
+  { RR1_BIT(C91_SDORX), RR2_BIT(C91_SDORX) },
+  { 0xFF,               0xFF               }  /* Anything else */
+};
+
+/* Number of the lowest bit set in a nibble (index 0 not used) */
+const BYTE LOWEST_BIT[16] =
+{
+  0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
 /* Toggle bit for the Emergency CAN-message */
 static BYTE CanEmgToggle = 0x80;
 
+#ifdef _SPI_STATS_
+/* ------------------------------------------------------------------------ */
+/* SPI access accounting */
+
+/* Number of SPI clock pulses for a single register access
+   (1 address byte + 1 data byte) */
+#define SPI_CLKS_PER_ACCESS   16
+
+/* Number of SPI clock pulses for a burst access of 'n' registers
+   (1 address byte + n data bytes) */
+#define SPI_CLKS_PER_BURST(n) (8 + ((UINT32) (n) << 3))
+
+/* Call site currently accessing the CAN-controller */
+static BYTE   SpiSite = SPI_SITE_OTHER;
+
+/* Counters per call site */
+static UINT32 SpiReads[SPI_SITES];
+static UINT32 SpiWrites[SPI_SITES];
+static UINT32 SpiClocks[SPI_SITES];
+
+/* Attribute the register accesses in a function to a call site;
+   the previous site is restored on leaving, so nested calls
+   (e.g. can_write() called from can_check_for_errors())
+   and the interrupt routine do not disturb the accounting;
+   requires a local 'BYTE spi_site' */
+#define SPI_SITE_ENTER(site)  spi_site = SpiSite; SpiSite = (site)
+#define SPI_SITE_LEAVE()      SpiSite = spi_site
+#else
+#define SPI_SITE_ENTER(site)
+#define SPI_SITE_LEAVE()
+#endif /* _SPI_STATS_ */
+
+#ifdef _CAN_STATS_
+/* ------------------------------------------------------------------------ */
+/* Receive interrupt and message buffer statistics
+   (times in Timer3 ticks) */
+
+#ifdef _ELMB103_
+#error "_CAN_STATS_ requires Timer3, not available on the ATmega103"
+#endif /* _ELMB103_ */
+
+static UINT32 CanIsrCnt;        /* Number of CAN INT interrupts        */
+static UINT32 CanIsrTicks;      /* Total time spent in interrupt       */
+static UINT32 CanFrameCnt;      /* Number of messages buffered         */
+static UINT16 CanIsrTicksMax;   /* Longest interrupt                   */
+static BYTE   CanBufHighWater;  /* Max number of messages in buffer    */
+static UINT16 CanPrioLatTicksMax;/* Longest time in the priority lane  */
+
+/* Buffer-in to buffer-out time: for all messages and per message type */
+#define CAN_LAT_ALL     0
+#define CAN_LAT_SYNC    1
+#define CAN_LAT_RPDO    2
+#define CAN_LAT_SDO     3
+#define CAN_LAT_TYPES   4
+static UINT32 CanMsgCnt[CAN_LAT_TYPES];      /* Number of messages read */
+static UINT32 CanLatTicks[CAN_LAT_TYPES];    /* Total time in buffer    */
+static UINT16 CanLatTicksMax[CAN_LAT_TYPES]; /* Longest time in buffer  */
+static UINT16 CanOverrunCnt;    /* Number of buffer overrun events     */
+static UINT16 CanTxDropCnt;     /* Number of messages not queued       */
+static BYTE   CanTxQHighWater;  /* Max number of messages in a queue   */
+static UINT16 CanIsrStart;      /* Start of the current interrupt      */
+static UINT32 CanRpdoFastCnt;   /* Number of RPDOs handled in interrupt*/
+static UINT16 CanRpdoFastMax;   /* Longest interrupt start to handled  */
+
+static void can_stats_isr_done( UINT16 t_start );
+static void can_stats_latency ( BYTE type, UINT16 ticks );
+static UINT32 can_stats_lat_avg( BYTE type );
+static void can_stats_put     ( UINT32 val, BYTE *nbytes, BYTE *par );
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+/* ------------------------------------------------------------------------ */
+/* Frame counters and traffic share: the bits of the frames received
+   (i.e. accepted by this node's CAN-controller buffers) and transmitted
+   by this node, as a fraction of the bus capacity; this is this node's
+   own share of the bus traffic, not the bus load (frames for other
+   nodes are not seen) */
+
+/* Number of 1-second slots in the traffic share sliding window
+   (here must be a power of 2!); the slot currently being filled is not
+   used in the estimate, so the load is averaged over the last
+   CAN_SHARE_SLOTS-1 complete seconds */
+#define CAN_SHARE_SLOTS       8
+#define CAN_SHARE_SLOTS_MASK  (CAN_SHARE_SLOTS-1)
+
+/* Number of bits of a standard data or remote frame with 'dlc' data bytes,
+   including the 3-bit interframe space (stuff bits not included) */
+#define CAN_FRAME_BITS(dlc)   (47 + ((UINT16) (dlc) << 3))
+
+/* Frames received and transmitted per CAN-controller buffer
+   (RTRs are counted as received in buffer C91_RTR) */
+static UINT16 CanRxCnt[C91_MSG_BUFFERS];
+static UINT16 CanTxCnt[C91_MSG_BUFFERS];
+
+/* Error interrupt counters */
+static UINT16 CanWarningCnt;
+static UINT16 CanErrPassiveCnt;
+static UINT16 CanBusOffIntCnt;
+static UINT16 CanTransmCheckCnt;
+
+/* Bits per 1-second slot (frames received and transmitted by this node) */
+static UINT32 CanShareBits[CAN_SHARE_SLOTS];
+static BYTE   CanShareSlot;
+
+/* Seconds counter (incremented by the Timer1 interrupt routine)
+   and its value when the slots were last updated */
+BYTE          CanTrafficSecs = 0;
+static BYTE   CanTrafficSecsLast = 0;
+
+/* Copy of all counters, taken at the first segment of an SDO upload
+   of the traffic record, so that the host gets a consistent set */
+static BYTE   CanTrafficSnapshot[CAN_TRAFFIC_SIZE];
+static BYTE   CanTrafficIndex;
+
+static void can_traffic_account( BYTE object_no, BYTE dlc, BOOL transmit );
+static void can_traffic_window ( void );
+#endif /* _CAN_TRAFFIC_ */
+
 /* ------------------------------------------------------------------------ */
 /* Local prototypes */
 
 static BYTE can_check_for_msgs( void );
-static BYTE get_buf_index     ( void );
-static BYTE get_buf_cntr      ( void );
+static BYTE can_rtr_object    ( void );
+static BYTE lowest_bit        ( BYTE val );
+static BOOL can_buffer_msg    ( BYTE object_no );
+#ifndef _ELMB103_
+static void can_buffer_tstamp ( BYTE *msg );
+#endif /* _ELMB103_ */
+static BYTE can_read_msg_data ( BYTE object_no, BYTE *buf );
+#ifdef _RPDO_FAST_
+static void can_rpdo_fast     ( BYTE object_no );
+static void can_nmt_done      ( void );
+#endif /* _RPDO_FAST_ */
+static BYTE *get_buf          ( BYTE lane, BYTE index );
+static BYTE get_in_index      ( BYTE lane );
+static BYTE get_out_index     ( BYTE lane );
+static BYTE get_buf_cntr      ( BYTE lane );
 static BYTE bits_in_byte      ( BYTE val );
 
 static void can_load_config   ( void );
+#ifdef _CAN_AUTOBAUD_
+static BYTE can_autobaud      ( BYTE baudrate );
+static BOOL can_autobaud_listen( BYTE baudrate );
+#endif /* _CAN_AUTOBAUD_ */
+
+static void can_busoff_start  ( void );
+static BOOL can_busoff_recovery( void );
+
+static void can_load_msg      ( BYTE object_no, BYTE len, BYTE *msg_data );
+static BOOL can_buf_busy      ( BYTE object_no );
+static void can_txq_refill    ( void );
+static void can_int_mask_update( void );
 
 #ifdef _CAN_REFRESH_
+static BOOL can_refresh_step  ( void );
 static void can_descriptor_refresh( BYTE object_no );
-static void can_recv_descriptor_refresh( void );
+static BOOL can_config_refresh( void );
 #endif /* _CAN_REFRESH_ */
 
 /* ------------------------------------------------------------------------ */
@@ -243,6 +696,11 @@ BYTE can_read_reg( BYTE regaddr )
   /* Deselect CAN-controller */
   CAN_DESELECT();
 
+#ifdef _SPI_STATS_
+  ++SpiReads[SpiSite];
+  SpiClocks[SpiSite] += SPI_CLKS_PER_ACCESS;
+#endif /* _SPI_STATS_ */
+
   return byt;
 }
 
@@ -259,6 +717,60 @@ void can_write_reg( BYTE regaddr, BYTE byt )
 
   /* Deselect CAN-controller */
   CAN_DESELECT();
+
+#ifdef _SPI_STATS_
+  ++SpiWrites[SpiSite];
+  SpiClocks[SpiSite] += SPI_CLKS_PER_ACCESS;
+#endif /* _SPI_STATS_ */
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_read_burst( BYTE regaddr, BYTE n, BYTE *buf )
+{
+  /* Read 'n' consecutive registers, starting at 'regaddr', in a single
+     SPI transaction: the CAN-controller increments the register address
+     after each data byte as long as it remains selected */
+  BYTE i;
+
+  /* Select CAN-controller and read-mode */
+  CAN_SELECT();
+  CAN_READ_ENABLE();
+
+  spi_write( regaddr );
+  for( i=0; i<n; ++i ) buf[i] = spi_read();
+
+  /* Deselect CAN-controller */
+  CAN_DESELECT();
+
+#ifdef _SPI_STATS_
+  SpiReads[SpiSite]  += n;
+  SpiClocks[SpiSite] += SPI_CLKS_PER_BURST( n );
+#endif /* _SPI_STATS_ */
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_write_burst( BYTE regaddr, BYTE n, BYTE *buf )
+{
+  /* Write 'n' consecutive registers, starting at 'regaddr', in a single
+     SPI transaction (address auto-increment, see can_read_burst()) */
+  BYTE i;
+
+  /* Select CAN-controller and write-mode */
+  CAN_SELECT();
+  CAN_WRITE_ENABLE();
+
+  spi_write( regaddr );
+  for( i=0; i<n; ++i ) spi_write( buf[i] );
+
+  /* Deselect CAN-controller */
+  CAN_DESELECT();
+
+#ifdef _SPI_STATS_
+  SpiWrites[SpiSite] += n;
+  SpiClocks[SpiSite] += SPI_CLKS_PER_BURST( n );
+#endif /* _SPI_STATS_ */
 }
 
 /* ------------------------------------------------------------------------ */
@@ -290,6 +802,11 @@ void can_init( BOOL init_msg_buffer )
       CANopenErrorReg &= ~ERRREG_COMMUNICATION;
     }
 
+#ifdef _HW_SPI_
+  /* The SPI's SS pin (PB0) is a jumper input: disable the SPI */
+  spi_disable();
+#endif /* _HW_SPI_ */
+
   /* Prepare PORTB for jumper read-out */
   DDRB  = PORTB_DDR_FOR_JUMPERS;
   PORTB = PORTB_DATA_FOR_JUMPERS;
@@ -298,10 +815,58 @@ void can_init( BOOL init_msg_buffer )
   NodeID   = read_nodeid();
   baudrate = read_baudrate();
 
+  if( init_msg_buffer )
+    {
+      /* A baudrate in the CAN configuration overrules the jumpers */
+      CanBaudrateSrc = CAN_BAUDRATE_BY_JUMPERS;
+      if( CanBaudrateSel < CAN_BAUDRATES )
+	{
+	  baudrate       = CanBaudrateSel;
+	  CanBaudrateSrc = CAN_BAUDRATE_BY_CONFIG;
+	}
+    }
+  else
+    {
+      /* Keep the baudrate in use (at a Bus-off recovery, lifeguarding
+	 time-out, etc.): a new jumper setting or baudrate selection
+	 only takes effect at the next reset (of communication) */
+      baudrate = CanBaudrate;
+    }
+
   /* Set PORTB back to 'operational' setting */
   DDRB  = PORTB_DDR_OPERATIONAL;
   PORTB = PORTB_DATA_OPERATIONAL;
 
+#ifdef _HW_SPI_
+  /* (Re)enable the SPI for CAN-controller access */
+  spi_init();
+#endif /* _HW_SPI_ */
+
+#ifdef _CAN_AUTOBAUD_
+  if( init_msg_buffer && CanBaudrateSel == CAN_BAUDRATE_AUTO )
+    {
+      /* Detect the baudrate once after power-up/reset, it takes up to
+	 a few seconds (not again at a communication reset, a Bus-off
+	 recovery or any other reinitialisation); if it failed the jumper
+	 setting is used until the next reset */
+      if( (CanAutobaudTried & TRUE) == FALSE )
+	{
+	  CanAutobaudTried = TRUE;
+	  CanBaudrateAuto  = can_autobaud( baudrate );
+	}
+
+      if( CanBaudrateAuto != CAN_BAUDRATE_UNKNOWN )
+	{
+	  baudrate       = CanBaudrateAuto;
+	  CanBaudrateSrc = CAN_BAUDRATE_BY_AUTO;
+	}
+      else
+	{
+	  CanBaudrateSrc = CAN_BAUDRATE_AUTO_FAILED;
+	}
+    }
+#endif /* _CAN_AUTOBAUD_ */
+
   /* Set CAN-controller in configuration mode */
   can_write_reg( C91_MODE_STATUS_I, C91_RES | C91_IM );
 
@@ -329,11 +894,21 @@ void can_init( BOOL init_msg_buffer )
   can_write_reg( C91_CLOCKCONTROL_I, 0x80 );
   can_write_reg( C91_CLOCKCONTROL_I, 0x01 );
 
+  /* Remember the baudrate in use */
+  CanBaudrate = baudrate;
+
   /* Write the settings for the required CAN-bus baudrate */
   can_write_reg( C91_BRP_I, CAN_BAUDRATE_CONFIGS[baudrate][0] );
   can_write_reg( C91_BL1_I, CAN_BAUDRATE_CONFIGS[baudrate][1] );
   can_write_reg( C91_BL2_I, CAN_BAUDRATE_CONFIGS[baudrate][2] );
 
+#ifdef _CAN_REFRESH_
+  /* Remember them as read back, for the integrity check */
+  CanBitTiming[0] = can_read_reg( C91_BRP_I );
+  CanBitTiming[1] = can_read_reg( C91_BL1_I );
+  CanBitTiming[2] = can_read_reg( C91_BL2_I );
+#endif /* _CAN_REFRESH_ */
+
   /* Node-ID for Description Register is split over 2 bytes */
   id_hi = NodeID >> 3;
   id_lo = NodeID << 5;
@@ -342,25 +917,23 @@ void can_init( BOOL init_msg_buffer )
   canaddr = C91_DR00_I;
   for( bufno=0; bufno<C91_MSG_BUFFERS; ++bufno )
     {
-      BYTE desc_hi, desc_lo;
+      BYTE desc[2];
 
       /* Use the corresponding descriptor bytes */
-      desc_hi = CAN_DESCRIPTOR[bufno][0];
-      desc_lo = CAN_DESCRIPTOR[bufno][1];
+      desc[0] = CAN_DESCRIPTOR[bufno][0];
+      desc[1] = CAN_DESCRIPTOR[bufno][1];
 
       /* NMT and SYNC are broadcast messages: Node-ID is not in */
       if( bufno != C91_NMT && bufno != C91_SYNC )
 	{
 	  /* Node-ID is included in COB-ID */
-	  desc_hi |= id_hi;
-	  desc_lo |= id_lo;
+	  desc[0] |= id_hi;
+	  desc[1] |= id_lo;
 	}
 
       /* Write the CAN-controller's Descriptor Registers */
-      can_write_reg( canaddr, desc_hi );
-      ++canaddr;
-      can_write_reg( canaddr, desc_lo );
-      ++canaddr;
+      can_write_burst( canaddr, 2, desc );
+      canaddr += 2;
     }
 
   /* Receive-Interrupt Mask Registers
@@ -368,8 +941,22 @@ void can_init( BOOL init_msg_buffer )
   can_write_reg( C91_RECV_INTERRUPT_MASK1_I, 0xFF );
   can_write_reg( C91_RECV_INTERRUPT_MASK2_I, 0xFF );
 
-  /* Enable INT pin interrupt for received messages only */
-  can_write_reg( C91_INTERRUPT_MASK_I, C91_RECV_INT ); 
+  /* Any queued messages are lost... */
+  {
+    BYTE q;
+    for( q=0; q<CAN_TXQS; ++q )
+      {
+	CanTxQOut[q] = 0;
+	CanTxQCnt[q] = 0;
+      }
+    CanTxQueued      = 0;
+    CanNgDescPending = FALSE;
+  }
+
+  /* Enable INT pin interrupt for received messages only
+     (the Transmit interrupt is enabled only while messages are queued) */
+  CanIntMask = C91_RECV_INT;
+  can_write_reg( C91_INTERRUPT_MASK_I, CanIntMask ); 
 
   /* If Remote Frames are not required adjust
      the CAN-controller's configuration: disable Monitor Mode for buffer 0
@@ -399,12 +986,24 @@ void can_init( BOOL init_msg_buffer )
 
   if( init_msg_buffer )
     {
-      /* Initialize the CAN-message buffer and management stuff */
+      BYTE lane;
+
+      /* Initialize the CAN-message buffers and management stuff */
+      for( bufno=0; bufno<CAN_PRIO_BUFS; ++bufno )
+	CanPrioMsgBuf[bufno][MSG_VALID_I] = BUF_EMPTY;
       for( bufno=0; bufno<CAN_BUFS; ++bufno )
 	CanMsgBuf[bufno][MSG_VALID_I] = BUF_EMPTY;
       CanBufFull = FALSE;
-      MsgOutIndex1 = 0; MsgOutIndex2 = 0; MsgOutIndex3 = 0;
-      MsgCounter1  = 0; MsgCounter2  = 0; MsgCounter3  = 0;
+      CanSyncPending = FALSE;
+#ifdef _RPDO_FAST_
+      CanNmtOutCnt = CanNmtInCnt;
+      CanNmtRead   = FALSE;
+#endif /* _RPDO_FAST_ */
+      for( lane=0; lane<CAN_LANES; ++lane )
+	{
+	  prot_set( &MsgInIndex[lane], 0 );
+	  prot_set( &MsgOutIndex[lane], 0 );
+	}
     }
 
   /* Enable interrupt */
@@ -415,8 +1014,99 @@ void can_init( BOOL init_msg_buffer )
 #endif /* _ELMB103_ */
   CAN_INT_ENABLE(); /* Enable interrupt from CAN-controller */
 
-  CanRefreshIndex = C91_MSG_BUFFERS-1;
+#ifdef _CAN_REFRESH_
+  CanRefreshIndex = 0;
+  timer0_set_timeout_10ms( CAN_REFRESH, CAN_REFRESH_INTERVAL_10MS );
+#endif /* _CAN_REFRESH_ */
+
+  /* Any Bus-off recovery has now been done */
+  CanBusOffState = CAN_BUSOFF_IDLE;
+}
+
+#ifdef _CAN_AUTOBAUD_
+/* ------------------------------------------------------------------------ */
+
+static BYTE can_autobaud( BYTE baudrate )
+{
+  /* Find the baudrate of the bus, starting with the given one
+     (so that a correct jumper setting is found quickly);
+     returns CAN_BAUDRATE_UNKNOWN if nothing was found */
+  BYTE cycle, i;
+
+  for( cycle=0; cycle<CAN_AUTOBAUD_CYCLES; ++cycle )
+    for( i=0; i<CAN_BAUDRATES; ++i )
+      {
+	if( can_autobaud_listen( baudrate ) ) return baudrate;
+
+	++baudrate;
+	if( baudrate >= CAN_BAUDRATES ) baudrate = 0;
+      }
+
+  return CAN_BAUDRATE_UNKNOWN;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BOOL can_autobaud_listen( BYTE baudrate )
+{
+  /* Listen at the given baudrate: returns TRUE if CAN_AUTOBAUD_FRAMES
+     frames have been received within the listen window;
+     the CAN-controller's output drivers are off (Output Control = 0),
+     so this node does not disturb the bus: it does not acknowledge
+     frames and does not send error frames (a frame is still received
+     correctly thanks to the acknowledge of another node) */
+  BYTE i, frames, rr1, rr2;
+
+  /* Set CAN-controller in configuration mode */
+  can_write_reg( C91_MODE_STATUS_I, C91_RES | C91_IM );
+
+  /* Initialise registers 0 to 0x0A to zero
+     (including Output Control: drivers off, and all interrupts off) */
+  for( i=0; i<0x0B; ++i ) can_write_reg( i, 0x00 );
+
+  /* Monitor Mode: buffer 0 accepts all messages not received
+     by any of the other buffers */
+  can_write_reg( C91_CONTROL_I, C91_MONITOR_MODE );
+  can_write_reg( C91_INTERRUPT_I, 0x00 );
+
+  /* Clock Control */
+  can_write_reg( C91_CLOCKCONTROL_I, 0x80 );
+  can_write_reg( C91_CLOCKCONTROL_I, 0x01 );
+
+  can_write_reg( C91_BRP_I, CAN_BAUDRATE_CONFIGS[baudrate][0] );
+  can_write_reg( C91_BL1_I, CAN_BAUDRATE_CONFIGS[baudrate][1] );
+  can_write_reg( C91_BL2_I, CAN_BAUDRATE_CONFIGS[baudrate][2] );
+
+  /* Start listening (the error counters start at zero) */
+  can_write_reg( C91_MODE_STATUS_I, 0x00 );
+
+  frames = 0;
+  timer0_set_timeout_10ms( CAN_AUTOBAUD, CAN_AUTOBAUD_WINDOW_10MS );
+  while( !timer0_timeout( CAN_AUTOBAUD ) )
+    {
+      /* Keep the watchdog and the Slave processor happy */
+      watchdog();
+
+      /* Errors: the wrong baudrate, most likely */
+      if( can_read_reg( C91_MODE_STATUS_I ) & (C91_RWL | C91_BS) ) break;
+
+      /* Any message received (in any buffer) ? */
+      rr1 = can_read_reg( C91_RECV_READY1_I );
+      rr2 = can_read_reg( C91_RECV_READY2_I );
+      if( rr1 | rr2 )
+	{
+	  /* Release the buffer(s) */
+	  can_write_reg( C91_RECV_READY1_I, ~rr1 );
+	  can_write_reg( C91_RECV_READY2_I, ~rr2 );
+
+	  ++frames;
+	  if( frames >= CAN_AUTOBAUD_FRAMES ) return TRUE;
+	}
+    }
+
+  return FALSE;
 }
+#endif /* _CAN_AUTOBAUD_ */
 
 /* ------------------------------------------------------------------------ */
 
@@ -424,15 +1114,14 @@ BOOL can_msg_available( void )
 {
   BOOL available;
 
-  /* Need undisturbed access to buffer management variables !
-     (because even the get_buf_xxx() functions may alter variables,
-     due to the (self-correcting) majority voting mechanism) */
-  CAN_INT_DISABLE();
-
-  /* CAN-message available in buffer ? */
-  available = (get_buf_cntr() > 0);
+#ifdef _RPDO_FAST_
+  can_nmt_done();
+#endif /* _RPDO_FAST_ */
 
-  CAN_INT_ENABLE();
+  /* CAN-message available in buffer ?
+     (no need to disable the CAN INT interrupt: see get_buf_cntr()) */
+  available = (get_buf_cntr( CAN_LANE_PRIO ) > 0 ||
+	       get_buf_cntr( CAN_LANE_BULK ) > 0);
 
 #ifdef _VARS_IN_EEPROM_
   /* EEPROM access removed from CAN interrupt handling, do it here instead ! */
@@ -451,22 +1140,31 @@ BOOL can_msg_available( void )
 
 BYTE can_read( BYTE *pdlc, BYTE **ppmsg_data )
 {
-  BYTE cntr, object_no;
+  BYTE cntr, object_no, lane;
 
-  /* Need undisturbed access to buffer management variables !
-     (because even the get_buf_xxx() functions may alter variables,
-     due to the (self-correcting) majority voting mechanism) */
-  CAN_INT_DISABLE();
+  /* NB: the interrupt routine only adds messages to a lane and only
+     writes MsgInIndex, so no need to disable the CAN INT interrupt */
+
+#ifdef _RPDO_FAST_
+  can_nmt_done();
+#endif /* _RPDO_FAST_ */
 
-  cntr = get_buf_cntr();
+  /* Messages in the priority lane are handled first */
+  lane = CAN_LANE_PRIO;
+  cntr = get_buf_cntr( lane );
+  if( cntr == 0 )
+    {
+      lane = CAN_LANE_BULK;
+      cntr = get_buf_cntr( lane );
+    }
 
   /* Is any message available in the buffer ? */
   if( cntr > 0 )
     {
       BYTE index, *msg;
 
-      index     = get_buf_index();
-      msg       = CanMsgBuf[index];
+      index     = get_out_index( lane );
+      msg       = get_buf( lane, index );
       *pdlc     = msg[MSG_DLC_I];
       object_no = msg[MSG_OBJECT_I];
 
@@ -483,58 +1181,177 @@ BYTE can_read( BYTE *pdlc, BYTE **ppmsg_data )
 	  object_no = NO_OBJECT;
 	}
 
+      /* The next SYNC may be buffered again (do this before reading
+	 the time of reception: while a SYNC is pending can_buffer_msg()
+	 may update it, and before freeing the buffer) */
+      if( msg[MSG_OBJECT_I] == C91_SYNC ) CanSyncPending = FALSE;
+
+#ifdef _RPDO_FAST_
+      /* RPDOs go through the buffer until this NMT has been handled */
+      if( msg[MSG_OBJECT_I] == C91_NMT ) CanNmtRead = TRUE;
+#endif /* _RPDO_FAST_ */
+
+#ifndef _ELMB103_
+      if( object_no != NO_OBJECT )
+	{
+	  /* Time of reception of this message */
+	  CanReadTstamp = ((UINT16) msg[MSG_TSTAMP_I] |
+			   ((UINT16) msg[MSG_TSTAMP_I+1] << 8));
+	  if( object_no == C91_SYNC ) CanSyncTstamp = CanReadTstamp;
+	}
+#endif /* _ELMB103_ */
+
+#ifdef _CAN_STATS_
+      if( object_no != NO_OBJECT )
+	{
+	  /* Time the message spent in the buffer
+	     (NB: Timer3 wraps around after 1.049 s) */
+	  UINT16 ticks;
+	  ticks = timer3_read() - CanReadTstamp;
+	  can_stats_latency( CAN_LAT_ALL, ticks );
+	  if( object_no == C91_SYNC )
+	    can_stats_latency( CAN_LAT_SYNC, ticks );
+	  else if( object_no >= C91_RPDO1 && object_no <= C91_RPDO4 )
+	    can_stats_latency( CAN_LAT_RPDO, ticks );
+	  else if( object_no == C91_SDORX )
+	    can_stats_latency( CAN_LAT_SDO, ticks );
+	  if( lane == CAN_LANE_PRIO && ticks > CanPrioLatTicksMax )
+	    CanPrioLatTicksMax = ticks;
+	}
+#endif /* _CAN_STATS_ */
+
       /* Mark buffer as empty
 	 (NB: the contained message has not been handled yet!) */
       msg[MSG_VALID_I] = BUF_EMPTY;
 
-      /* Decrement the messages-in-buffer counter */
-      --cntr;
-      MsgCounter1 = cntr;  MsgCounter2 = cntr;  MsgCounter3 = cntr;
-
       /* Increment the buffer(-out) index to point to
-	 the next message to be handled (next time around) */
-      index = (index + 1) & CAN_BUFS_MASK;
-      MsgOutIndex1 = index;  MsgOutIndex2 = index;  MsgOutIndex3 = index;
-
-#ifdef __CAN_REFRESH__
-      /* Refresh the descriptors of one of the receiving buffers */
-      can_recv_descriptor_refresh();
-#endif /* __CAN_REFRESH__ */
+	 the next message to be handled (next time around);
+	 this frees the buffer for the interrupt routine (but it is kept
+	 'free' until the next message is read: see can_buffer_msg()) */
+      index = (index + 1) & (CAN_LANE_BUFS[lane]-1);
+      prot_set( &MsgOutIndex[lane], index );
+
+      /* (Re)enable the interrupt, in case it was disabled
+	 because the buffer was full */
+      CAN_INT_ENABLE();
     }
   else
     {
       object_no = NO_OBJECT;
     }
 
-  CAN_INT_ENABLE();
-
   return object_no;;
 }
 
+#ifndef _ELMB103_
 /* ------------------------------------------------------------------------ */
 
-void can_write( BYTE object_no, BYTE len, BYTE *msg_data )
+UINT16 can_read_timestamp( void )
 {
-  BYTE addr;
-  signed char byt;
+  /* Time of reception (Timer3 value, see T3_MUS_PER_TICK) of the message
+     last returned by can_read() */
+  return CanReadTstamp;
+}
+
+/* ------------------------------------------------------------------------ */
+
+UINT16 can_sync_timestamp( void )
+{
+  /* Time of reception (Timer3 value) of the last SYNC message
+     returned by can_read(): e.g. to timestamp a measurement relative
+     to the SYNC use (timer3_read() - can_sync_timestamp())
+     (NB: Timer3 wraps around after 1.049 s) */
+  return CanSyncTstamp;
+}
+#endif /* _ELMB103_ */
+
+/* ------------------------------------------------------------------------ */
+
+BOOL can_write( BYTE object_no, BYTE len, BYTE *msg_data )
+{
+  /* Send the message or, if the buffer is still busy with a previous
+     message, queue it; returns FALSE if the message could not be queued */
+  BYTE q;
+  BOOL result;
+#ifdef _SPI_STATS_
+  BYTE spi_site;
+#endif
 
   /* Legal message object ? */
-  if( object_no > C91_MSG_BUFFERS-1 ) return;
+  if( object_no > C91_MSG_BUFFERS-1 ) return FALSE;
+  q = CAN_TXQ_NO[object_no];
+  if( q == NO_TXQ ) return FALSE;
+  if( len > 8 ) len = 8;
 
   CAN_INT_DISABLE(); /* Need undisturbed access to CAN-controller ! */
 
-#ifdef _CAN_REFRESH_
-  /* Refresh descriptor registers for this CAN message */
-  can_descriptor_refresh( object_no );
-#endif /* _CAN_REFRESH_ */
+  SPI_SITE_ENTER( SPI_SITE_WRITE );
+
+  result = TRUE;
+
+  if( CanTxQCnt[q] == 0 && !can_buf_busy( object_no ) )
+    {
+      can_load_msg( object_no, len, msg_data );
+    }
+  else if( CanTxQCnt[q] < CAN_TXQ_DEPTH )
+    {
+      /* Queue it: sent after the message(s) before it (can_txq_refill()) */
+      BYTE *entry, i;
+      entry = CanTxQ[q][(CanTxQOut[q] + CanTxQCnt[q]) & (CAN_TXQ_DEPTH-1)];
+      for( i=0; i<len; ++i ) entry[i] = msg_data[i];
+      entry[TXQ_LEN_I] = len;
+      ++CanTxQCnt[q];
+      ++CanTxQueued;
+
+#ifdef _CAN_STATS_
+      if( CanTxQCnt[q] > CanTxQHighWater ) CanTxQHighWater = CanTxQCnt[q];
+#endif /* _CAN_STATS_ */
+
+      /* Make sure the Transmit interrupt is enabled */
+      can_int_mask_update();
+    }
+  else
+    {
+      /* Queue full: message is lost */
+#ifdef _CAN_STATS_
+      if( CanTxDropCnt != 0xFFFF ) ++CanTxDropCnt;
+#endif /* _CAN_STATS_ */
+      result = FALSE;
+    }
+
+  SPI_SITE_LEAVE();
+
+  CAN_INT_ENABLE();
+
+  return result;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_load_msg( BYTE object_no, BYTE len, BYTE *msg_data )
+{
+  /* Copy a message to a (free) transmit buffer and start transmission
+     (called with the CAN INT interrupt disabled or from the interrupt) */
+  BYTE addr;
+  signed char byt;
 
   /* Determine object's message buffer address */
   addr = C91_MSGS_I + (object_no * C91_MSG_SIZE);
 
   /* Write the data bytes to the message buffer;
-     go from MSB to byte 0...! */
-  addr += (len-1);
-  for( byt=len-1; byt>=0; --byt, --addr ) can_write_reg( addr, msg_data[byt] );
+     go from MSB to byte 0...!
+     so start with the highest byte and end with byte 0 in separate
+     accesses, and write any bytes in between in a single burst */
+  if( len > 0 )
+    {
+      byt = len-1;
+      if( byt > 0 )
+	{
+	  can_write_reg( addr + byt, msg_data[byt] );
+	  if( byt > 1 ) can_write_burst( addr + 1, byt-1, &msg_data[1] );
+	}
+      can_write_reg( addr, msg_data[0] );
+    }
 
   /* Set the appropriate transmission request bit */
   if( object_no > C91_MSG_BUFFERS_PER_RRR-1 )
@@ -543,27 +1360,105 @@ void can_write( BYTE object_no, BYTE len, BYTE *msg_data )
   else
     can_write_reg( C91_TRANSMIT_REQ1_I, BIT(object_no) );
 
-#ifdef __CAN_REFRESH__
-  /* Refresh the descriptors of one of the receiving buffers */
-  /* ### Don't: you may loose a message */
-  //can_recv_descriptor_refresh();
-#endif /* __CAN_REFRESH__ */
+#ifdef _CAN_TRAFFIC_
+  can_traffic_account( object_no, len, TRUE );
+#endif /* _CAN_TRAFFIC_ */
+}
 
-  CAN_INT_ENABLE();
+/* ------------------------------------------------------------------------ */
+
+static BOOL can_buf_busy( BYTE object_no )
+{
+  /* Is the transmit buffer still waiting for its message to be sent ?
+     (called with the CAN INT interrupt disabled or from the interrupt) */
+  if( object_no < C91_MSG_BUFFERS_PER_RRR )
+    return( (can_read_reg(C91_TRANSMIT_REQ1_I) & BIT(object_no)) != 0 );
+  else
+    return( (can_read_reg(C91_TRANSMIT_REQ2_I) &
+	     BIT(object_no - C91_MSG_BUFFERS_PER_RRR)) != 0 );
 }
 
 /* ------------------------------------------------------------------------ */
 
-void can_write_bootup( void )
+static void can_txq_refill( void )
 {
-  BYTE can_data[C91_BOOTUP_LEN];
-  BYTE ng;
+  /* Called from the CAN INT interrupt routine:
+     load the first queued message of each queue into its transmit buffer,
+     if that buffer is free; apply a pending NodeGuard descriptor update */
+  BYTE q, object_no, tr1, tr2, busy;
 
-  /* RTR bit (for NodeGuard message) -if present- must be temporarily removed
-     when sending the BOOTUP message (Bootup and NodeGuard use the same
-     message buffer!) and is restored by can_rtr_enable() */
-  CAN_INT_DISABLE();
-  ng = can_read_reg( C91_DR00_I+C91_NODEGUARD*2+1 );
+  /* Reset the Transmit interrupt bit first: a message sent after
+     reading the Transmit Request registers then sets it again */
+  can_write_reg( C91_INTERRUPT_I, (BYTE)(~C91_TRANSM_INT) );
+
+  tr1 = can_read_reg( C91_TRANSMIT_REQ1_I );
+  tr2 = can_read_reg( C91_TRANSMIT_REQ2_I );
+
+  for( q=0; q<CAN_TXQS; ++q )
+    {
+      object_no = CAN_TXQ_OBJECT[q];
+      if( object_no < C91_MSG_BUFFERS_PER_RRR )
+	busy = tr1 & BIT(object_no);
+      else
+	busy = tr2 & BIT(object_no - C91_MSG_BUFFERS_PER_RRR);
+
+      if( CanTxQCnt[q] > 0 && !busy )
+	{
+	  BYTE *entry;
+	  entry = CanTxQ[q][CanTxQOut[q]];
+	  can_load_msg( object_no, entry[TXQ_LEN_I], entry );
+	  CanTxQOut[q] = (CanTxQOut[q] + 1) & (CAN_TXQ_DEPTH-1);
+	  --CanTxQCnt[q];
+	  --CanTxQueued;
+	  busy = TRUE;
+	}
+
+      if( object_no == C91_NODEGUARD && CanNgDescPending && !busy )
+	{
+	  /* Bootup/NodeGuard buffer free: now update its descriptor
+	     and keep the node state in it up-to-date (see can_rtr_enable()) */
+	  can_write_reg( C91_DR00_I + C91_NODEGUARD*2+1, CanNgDesc );
+	  can_write_reg( C91_MSGS_I + (C91_NODEGUARD*C91_MSG_SIZE),
+			 NodeState | (NodeGuardToggle & 0x80) );
+	  CanNgDescPending = FALSE;
+	}
+    }
+
+  /* Disable the Transmit interrupt when there is nothing left to do */
+  can_int_mask_update();
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_int_mask_update( void )
+{
+  /* Enable the CAN-controller's Transmit interrupt only while there are
+     queued messages or a pending descriptor update
+     (called with the CAN INT interrupt disabled or from the interrupt) */
+  BYTE mask;
+
+  mask = C91_RECV_INT;
+  if( CanTxQueued > 0 || CanNgDescPending ) mask |= C91_TRANSM_INT;
+
+  if( mask != CanIntMask )
+    {
+      CanIntMask = mask;
+      can_write_reg( C91_INTERRUPT_MASK_I, mask );
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_write_bootup( void )
+{
+  BYTE can_data[C91_BOOTUP_LEN];
+  BYTE ng;
+
+  /* RTR bit (for NodeGuard message) -if present- must be temporarily removed
+     when sending the BOOTUP message (Bootup and NodeGuard use the same
+     message buffer!) and is restored by can_rtr_enable() */
+  CAN_INT_DISABLE();
+  ng = can_read_reg( C91_DR00_I+C91_NODEGUARD*2+1 );
   can_write_reg( C91_DR00_I+C91_NODEGUARD*2+1, ng & (~C91_DR_RTR_MASK) );
   CAN_INT_ENABLE();
 
@@ -604,18 +1499,7 @@ void can_write_emergency( BYTE err_low,
   msg_data[6] = mfct_field_3;
   msg_data[7] = (CanEmgToggle & 0x80);
 
-  /* Make sure the message does not get lost:
-     wait for the previous one to be sent */
-  {
-    BYTE delay=0;
-    while( can_transmitting(C91_EMERGENCY) && delay < 50 )
-      {
-	/* So wait, but not forever... */
-	timer2_delay_ms( 1 );
-	++delay;
-      }
-  }
-
+  /* If the previous one has not been sent yet the message is queued */
   can_write( C91_EMERGENCY, C91_EMERGENCY_LEN, msg_data );
 
   /* Toggle the toggle bit */
@@ -627,9 +1511,28 @@ void can_write_emergency( BYTE err_low,
 void can_check_for_errors( void )
 {
   BYTE interrupts, status;
+#ifdef _SPI_STATS_
+  BYTE spi_site;
+#endif
+
+  SPI_SITE_ENTER( SPI_SITE_ERRORS );
+
+  /* Waiting to regain bus access after a Bus-off ?
+     (nothing else to check while the CAN-controller is off the bus) */
+  if( CanBusOffState == CAN_BUSOFF_WAITING )
+    {
+      can_busoff_recovery();
+      SPI_SITE_LEAVE();
+      return;
+    }
 
   CAN_INT_DISABLE();
 
+#ifdef _CAN_TRAFFIC_
+  /* Keep the traffic share window up-to-date, also without traffic */
+  can_traffic_window();
+#endif /* _CAN_TRAFFIC_ */
+
   interrupts = can_read_reg( C91_INTERRUPT_I );
 
   /* Detect whether a Nodeguarding message has been (automatically) serviced
@@ -661,6 +1564,15 @@ void can_check_for_errors( void )
     if( can_read_reg( C91_OUTPUTCONTROL_I ) != 0x18 )
       if( can_read_reg( C91_OUTPUTCONTROL_I ) != 0x18 )
 	rst = TRUE;
+
+#ifdef _CAN_REFRESH_
+    /* Next step in refreshing the CAN-controller's registers */
+    if( rst == FALSE && timer0_timeout( CAN_REFRESH ) )
+      {
+	timer0_set_timeout_10ms( CAN_REFRESH, CAN_REFRESH_INTERVAL_10MS );
+	if( can_refresh_step() == FALSE ) rst = TRUE;
+      }
+#endif /* _CAN_REFRESH_ */
     CAN_INT_ENABLE();
 
     if( rst )
@@ -670,6 +1582,7 @@ void can_check_for_errors( void )
 	can_write_emergency( 0x00, 0x81, 0x00, 0x00,
 			     CanErrorCntr, CanBusOffCnt,
 			     ERRREG_COMMUNICATION );
+	SPI_SITE_LEAVE();
 	return;
       }
   }
@@ -682,25 +1595,51 @@ void can_check_for_errors( void )
     {
       ++CanErrorCntr;
 
+#ifdef _CAN_TRAFFIC_
+      if( interrupts & C91_WARNING_LEVEL_INT ) ++CanWarningCnt;
+      if( interrupts & C91_ERROR_PASSIVE_INT ) ++CanErrPassiveCnt;
+      if( interrupts & C91_BUS_OFF_INT )       ++CanBusOffIntCnt;
+      if( interrupts & C91_TRANSM_CHECK_INT )  ++CanTransmCheckCnt;
+#endif /* _CAN_TRAFFIC_ */
+
       CAN_INT_DISABLE();
       status = can_read_reg( C91_MODE_STATUS_I );
       CAN_INT_ENABLE();
 
       if( interrupts & C91_BUS_OFF_INT )
 	{
-	  /* Aye... we're off the bus, try to recover,
-	     but not before taking a break... */
-	  timer2_delay_ms( 50 );
-	  timer2_delay_ms( 50 );
-
 	  ++CanBusOffCnt;
 #ifdef _VARS_IN_EEPROM_
-	  CanBusOffMaxCnt = eeprom_read( EE_CAN_BUSOFF_MAXCNT );
+	  CanBusOffMaxCnt  = eeprom_read( EE_CAN_BUSOFF_MAXCNT );
+	  CanBusOffBackoff = eeprom_read( EE_CAN_BUSOFF_BACKOFF );
 #endif /* _VARS_IN_EEPROM_ */
 
-	  /* Regain access to CAN-bus,
-	     unless the number of re-inits exceeds a preset value */
-	  if( CanBusOffCnt <= CanBusOffMaxCnt ) can_init( FALSE );
+	  /* Start a new series of Bus-offs after a quiet period */
+	  if( CanBusOffQuiet == 0 ) CanBusOffSeries = 0;
+	  if( CanBusOffSeries != 0xFF ) ++CanBusOffSeries;
+
+	  /* Aye... we're off the bus, try to recover,
+	     unless the number of re-inits exceeds a preset value,
+	     but not before taking a break... (without waiting here:
+	     the rest of the main loop continues meanwhile);
+	     report it when we're back on the bus */
+	  if( CanBusOffCnt <= CanBusOffMaxCnt &&
+	      (CanBusOffBackoff == 0 || CanBusOffSeries <= CanBusOffMaxCnt) )
+	    {
+	      CanBusOffInts   = interrupts;
+	      CanBusOffStatus = status;
+
+	      /* Reset interrupt bits (except the Remote Frame interrupt) */
+	      CAN_INT_DISABLE();
+	      can_write_reg( C91_INTERRUPT_I,
+			     (~interrupts) | C91_REMOTE_FRAME_INT );
+	      CAN_INT_ENABLE();
+
+	      can_busoff_start();
+
+	      SPI_SITE_LEAVE();
+	      return;
+	    }
 	}
 
       can_write_emergency( 0x00, 0x81, interrupts, status,
@@ -719,27 +1658,125 @@ void can_check_for_errors( void )
       can_write_emergency( 0x10, 0x81, 0, 0, 0, 0, ERRREG_COMMUNICATION );
       CanBufFull = FALSE;
     }
+
+#ifdef _VARS_IN_EEPROM_
+  CanSyncEmgThreshold = eeprom_read( EE_CAN_SYNC_EMG_THRESHOLD );
+#endif /* _VARS_IN_EEPROM_ */
+
+  if( CanSyncEmgThreshold > 0 )
+    {
+      UINT16 dropped;
+
+      /* Number of SYNCs dropped since the previous report */
+      CAN_INT_DISABLE();
+      dropped = CanSyncDroppedCnt - CanSyncReportedCnt;
+      CAN_INT_ENABLE();
+
+      if( dropped > (UINT16) CanSyncEmgThreshold )
+	{
+	  /* Report it: 'CAN overrun' emergency type:
+	     this node does not keep up with the SYNC rate */
+	  can_write_emergency( 0x10, 0x81, EMG_SYNC_OVERRUN,
+			       (BYTE) (dropped & 0x00FF),
+			       (BYTE) ((dropped & 0xFF00) >> 8), 0,
+			       ERRREG_COMMUNICATION );
+	  CanSyncReportedCnt += dropped;
+	}
+    }
+
+  SPI_SITE_LEAVE();
 }
 
 /* ------------------------------------------------------------------------ */
 
-BOOL can_transmitting( BYTE object_no )
+static void can_busoff_start( void )
 {
-  BOOL not_ready;
-  not_ready = TRUE;
+  /* Start the back-off time before regaining bus access after a Bus-off */
+  BYTE   doublings;
+  UINT16 wait;
 
-  CAN_INT_DISABLE();
+#ifdef _VARS_IN_EEPROM_
+  CanBusOffBackoff = eeprom_read( EE_CAN_BUSOFF_BACKOFF );
+#endif /* _VARS_IN_EEPROM_ */
 
-  if( object_no < C91_MSG_BUFFERS_PER_RRR )
+  /* Exponential back-off: the first Bus-off of a series uses the base
+     time, each next one doubles it, up to the configured limit */
+  doublings = CanBusOffSeries - 1;
+  if( doublings > CanBusOffBackoff ) doublings = CanBusOffBackoff;
+  if( doublings > CAN_BUSOFF_BACKOFF_MAX ) doublings = CAN_BUSOFF_BACKOFF_MAX;
+  wait = ((UINT16) CAN_BUSOFF_WAIT_10MS) << doublings;
+
+  /* Timer0 time-outs are at most 255 x 10 ms: do it in steps */
+  if( wait > 255 )
     {
-      not_ready = can_read_reg(C91_TRANSMIT_REQ1_I) & BIT(object_no);
+      CanBusOffWait = wait - 255;
+      wait = 255;
     }
   else
     {
-      object_no -= C91_MSG_BUFFERS_PER_RRR;
-      not_ready = can_read_reg(C91_TRANSMIT_REQ2_I) & BIT(object_no);
+      CanBusOffWait = 0;
+    }
+  timer0_set_timeout_10ms( CAN_BUSOFF, (BYTE) wait );
+
+  CanBusOffState = CAN_BUSOFF_WAITING;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BOOL can_busoff_recovery( void )
+{
+  /* Called regularly while waiting after a Bus-off: when the back-off
+     time has expired reinitialize the CAN-controller and report
+     the Bus-off; returns TRUE when back on the bus */
+  if( !timer0_timeout( CAN_BUSOFF ) ) return FALSE;
+
+  if( CanBusOffWait > 0 )
+    {
+      /* Next step of the back-off time */
+      if( CanBusOffWait > 255 )
+	{
+	  CanBusOffWait -= 255;
+	  timer0_set_timeout_10ms( CAN_BUSOFF, 255 );
+	}
+      else
+	{
+	  timer0_set_timeout_10ms( CAN_BUSOFF, (BYTE) CanBusOffWait );
+	  CanBusOffWait = 0;
+	}
+      return FALSE;
     }
 
+  /* Regain access to CAN-bus (also ends the Bus-off state) */
+  can_init( FALSE );
+
+  /* The series of Bus-offs ends if none follows within the quiet period */
+  CanBusOffQuiet = CAN_BUSOFF_QUIET_SECS;
+
+  can_write_emergency( 0x00, 0x81, CanBusOffInts, CanBusOffStatus,
+		       CanErrorCntr, CanBusOffCnt,
+		       ERRREG_COMMUNICATION );
+
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------ */
+
+BOOL can_transmitting( BYTE object_no )
+{
+  /* Message(s) for this buffer not yet sent, or still in its queue ? */
+  BOOL not_ready;
+  BYTE q;
+
+  if( object_no > C91_MSG_BUFFERS-1 ) return FALSE;
+
+  CAN_INT_DISABLE();
+
+  q = CAN_TXQ_NO[object_no];
+  if( q != NO_TXQ && CanTxQCnt[q] > 0 )
+    not_ready = TRUE;
+  else
+    not_ready = can_buf_busy( object_no );
+
   CAN_INT_ENABLE();
 
   return not_ready;
@@ -747,9 +1784,35 @@ BOOL can_transmitting( BYTE object_no )
 
 /* ------------------------------------------------------------------------ */
 
+BOOL can_txq_full( BYTE object_no )
+{
+  /* Would can_write() for this buffer fail now, because its queue is full ?
+     (for callers that retry later: a failing can_write() counts
+      the message as dropped; the queue only gets emptier meanwhile) */
+  BOOL full;
+  BYTE q;
+
+  if( object_no > C91_MSG_BUFFERS-1 ) return TRUE;
+  q = CAN_TXQ_NO[object_no];
+  if( q == NO_TXQ ) return TRUE;
+
+  CAN_INT_DISABLE();
+  full = (CanTxQCnt[q] >= CAN_TXQ_DEPTH);
+  CAN_INT_ENABLE();
+
+  return full;
+}
+
+/* ------------------------------------------------------------------------ */
+
 void can_rtr_enable( BOOL enable )
 {
-  BYTE ctrl, ng, delay;
+  BYTE ctrl, ng;
+#ifdef _SPI_STATS_
+  BYTE spi_site;
+#endif
+
+  SPI_SITE_ENTER( SPI_SITE_RTR );
 
   CAN_INT_DISABLE();
 
@@ -767,11 +1830,13 @@ void can_rtr_enable( BOOL enable )
     {
       ctrl &= ~C91_MONITOR_MODE;
       ng   |= C91_DR_RTR_MASK;
+      CanRtrEnabled = FALSE;
     }
   else
     {
       ctrl |= C91_MONITOR_MODE;
       ng   &= ~C91_DR_RTR_MASK;
+      CanRtrEnabled = TRUE;
     }
   can_write_reg( C91_CONTROL_I, ctrl );
 
@@ -779,27 +1844,30 @@ void can_rtr_enable( BOOL enable )
   can_write_reg( C91_DR00_I + C91_RTR*2,   CAN_DESCRIPTOR[C91_RTR][0] );
   can_write_reg( C91_DR00_I + C91_RTR*2+1, CAN_DESCRIPTOR[C91_RTR][1] );
 
-  CAN_INT_ENABLE();
-
-  /* Don't touch BOOTUP/NODEGUARD buffer until *after* a message has been sent.
-     The following doesn't fully guarantee the message has been sent,
-     but we'd like to keep it simple... */
-  delay = 0;
-  while( can_transmitting(C91_BOOTUP) && delay < 50 )
+  /* Don't touch BOOTUP/NODEGUARD buffer until *after* a message has been sent:
+     if it is still busy (or has messages queued) the update is done
+     by the interrupt routine, when the buffer has become free */
+  if( CanTxQCnt[CAN_TXQ_NO[C91_NODEGUARD]] > 0 ||
+      can_buf_busy( C91_NODEGUARD ) )
     {
-      timer2_delay_ms( 1 );
-      ++delay;
+      CanNgDesc        = ng;
+      CanNgDescPending = TRUE;
+      can_int_mask_update();
     }
+  else
+    {
+      CanNgDescPending = FALSE;
 
-  CAN_INT_DISABLE();
+      can_write_reg( C91_DR00_I + C91_NODEGUARD*2+1, ng );
 
-  can_write_reg( C91_DR00_I + C91_NODEGUARD*2+1, ng );
+      /* Keep node state in NodeGuard message buffer up-to-date
+	 (in case we now switch from non-automatic (see guarding.c) to
+	 automatic reply, and at boot-up) */
+      can_write_reg( C91_MSGS_I + (C91_NODEGUARD*C91_MSG_SIZE),
+		     NodeState | (NodeGuardToggle & 0x80) );
+    }
 
-  /* Keep node state in NodeGuard message buffer up-to-date
-     (in case we now switch from non-automatic (see guarding.c) to
-     automatic reply, and at boot-up) */
-  can_write_reg( C91_MSGS_I + (C91_NODEGUARD*C91_MSG_SIZE),
-		 NodeState | (NodeGuardToggle & 0x80) );
+  SPI_SITE_LEAVE();
 
   CAN_INT_ENABLE();
 }
@@ -839,12 +1907,80 @@ BOOL can_get_rtr_disabled( void )
 /* ------------------------------------------------------------------------ */
 
 #ifdef _CAN_REFRESH_
+static BOOL can_refresh_step( void )
+{
+  /* Refresh the next descriptor or the configuration registers
+     (called with the CAN INT interrupt disabled);
+     returns FALSE if the CAN-controller needs to be reinitialised */
+  BYTE object_no;
+  BOOL skip;
+  BOOL result = TRUE;
+#ifdef _SPI_STATS_
+  BYTE spi_site;
+#endif
+
+  SPI_SITE_ENTER( SPI_SITE_REFRESH );
+
+  if( CanRefreshIndex >= CAN_REFRESH_STEPS ) CanRefreshIndex = 0;
+
+  if( CanRefreshIndex < C91_MSG_BUFFERS )
+    {
+      object_no = CanRefreshIndex;
+      skip      = FALSE;
+
+      if( object_no == C91_RTR )
+	{
+	  /* Do not refresh the RTR buffer: an RTR may get lost */
+	  skip = TRUE;
+	}
+      else if( CAN_TXQ_NO[object_no] != NO_TXQ )
+	{
+	  /* Don't touch a transmit buffer while it is busy (or has messages
+	     queued or a descriptor update pending): next round */
+	  if( CanTxQCnt[CAN_TXQ_NO[object_no]] > 0 ||
+	      can_buf_busy( object_no ) ||
+	      (object_no == C91_NODEGUARD && CanNgDescPending) )
+	    skip = TRUE;
+	}
+      else
+	{
+	  /* Don't touch a receive buffer holding a message that has not
+	     been read yet (its DLC would be overwritten): next round */
+	  BYTE rr[2];
+	  can_read_burst( C91_RECV_READY1_I, 2, rr );
+	  if( ((rr[0] | ObjectMask1) & RR1_BIT(object_no)) ||
+	      ((rr[1] | ObjectMask2) & RR2_BIT(object_no)) )
+	    skip = TRUE;
+	}
+
+      if( skip == FALSE ) can_descriptor_refresh( object_no );
+    }
+  else
+    {
+      if( can_config_refresh() == FALSE )
+	if( can_config_refresh() == FALSE )
+	  result = FALSE;
+    }
+
+  ++CanRefreshIndex;
+
+  SPI_SITE_LEAVE();
+
+  return result;
+}
+
+/* ------------------------------------------------------------------------ */
+
 static void can_descriptor_refresh( BYTE object_no )
 {
-  BYTE desc_hi, desc_lo, addr;
+  BYTE desc[2];
 
-  desc_hi = CAN_DESCRIPTOR[object_no][0];
-  desc_lo = CAN_DESCRIPTOR[object_no][1];
+  desc[0] = CAN_DESCRIPTOR[object_no][0];
+  desc[1] = CAN_DESCRIPTOR[object_no][1];
+
+  /* Automatic reply to NodeGuard RTRs (see can_rtr_enable()) */
+  if( object_no == C91_NODEGUARD && CanRtrEnabled == FALSE )
+    desc[1] |= C91_DR_RTR_MASK;
 
   /* NMT and SYNC are broadcast messages: Node-ID is not in */
   if( object_no != C91_NMT && object_no != C91_SYNC )
@@ -855,40 +1991,40 @@ static void can_descriptor_refresh( BYTE object_no )
 #endif /* _VARS_IN_EEPROM_ */
 
       /* Node-ID is included in COB-ID */
-      desc_hi |= (NodeID >> 3);
-      desc_lo |= (NodeID << 5);
+      desc[0] |= (NodeID >> 3);
+      desc[1] |= (NodeID << 5);
     }
 
   /* Write descriptor bytes */
-  addr = C91_DR00_I + object_no*2;
-  can_write_reg( addr, desc_hi );
-  ++addr;
-  can_write_reg( addr, desc_lo );
+  can_write_burst( C91_DR00_I + object_no*2, 2, desc );
 }
-#endif /* _CAN_REFRESH_ */
 
 /* ------------------------------------------------------------------------ */
 
-#ifdef __CAN_REFRESH__
-static void can_recv_descriptor_refresh( void )
+static BOOL can_config_refresh( void )
 {
-  BYTE i;
-  /* Find a next CAN-controller buffer which is a receiver
-     and refresh its descriptor */
-  for( i=0; i<C91_MSG_BUFFERS; ++i )
-    {
-      /* Modulo increment of index */
-      CanRefreshIndex = (CanRefreshIndex + 1) & (C91_MSG_BUFFERS-1);
+  /* Rewrite the configuration registers that may be written while
+     the CAN-controller is operational, check the bit timing registers
+     (which may not) against their values after initialisation;
+     returns FALSE if these have changed */
+  BYTE ctrl;
 
-      if( CANBUF_IS_RECV[CanRefreshIndex] )
-	{
-	  can_descriptor_refresh( CanRefreshIndex );
-	  /* Refresh only one descriptor at a time... */
-	  break;
-	}
-    }
+  can_write_reg( C91_RECV_INTERRUPT_MASK1_I, 0xFF );
+  can_write_reg( C91_RECV_INTERRUPT_MASK2_I, 0xFF );
+  can_write_reg( C91_INTERRUPT_MASK_I, CanIntMask );
+
+  ctrl = C91_TRANSMIT_CHECK_ENABLE;
+  if( CanRtrEnabled ) ctrl |= C91_MONITOR_MODE;
+  can_write_reg( C91_CONTROL_I, ctrl );
+
+  if( can_read_reg( C91_BRP_I ) != CanBitTiming[0] ||
+      can_read_reg( C91_BL1_I ) != CanBitTiming[1] ||
+      can_read_reg( C91_BL2_I ) != CanBitTiming[2] )
+    return FALSE;
+
+  return TRUE;
 }
-#endif /* __CAN_REFRESH__ */
+#endif /* _CAN_REFRESH_ */
 
 /* ------------------------------------------------------------------------ */
 
@@ -970,346 +2106,1051 @@ BYTE can_get_busoff_maxcnt( void )
 
 /* ------------------------------------------------------------------------ */
 
-/* Up to 16 bytes of configuration parameters can be stored */
-#define CAN_STORE_SIZE 3
+BOOL can_set_busoff_backoff( BYTE doublings )
+{
+  if( doublings > CAN_BUSOFF_BACKOFF_MAX ) return FALSE;
+
+  CanBusOffBackoff = doublings;
+
+#ifdef _VARS_IN_EEPROM_
+  if( eeprom_read( EE_CAN_BUSOFF_BACKOFF ) != CanBusOffBackoff )
+    eeprom_write( EE_CAN_BUSOFF_BACKOFF, CanBusOffBackoff );
+#endif /* _VARS_IN_EEPROM_ */
+
+  return TRUE;
+}
 
 /* ------------------------------------------------------------------------ */
 
-BOOL can_store_config( void )
+BYTE can_get_busoff_backoff( void )
 {
-  BYTE block[CAN_STORE_SIZE];
-
 #ifdef _VARS_IN_EEPROM_
-  RtrDisabled        = eeprom_read( EE_RTR_DISABLED );
-  CANopenOpStateInit = eeprom_read( EE_CANOPEN_OPSTATE_INIT );
-  CanBusOffMaxCnt    = eeprom_read( EE_CAN_BUSOFF_MAXCNT );
+  CanBusOffBackoff = eeprom_read( EE_CAN_BUSOFF_BACKOFF );
 #endif /* _VARS_IN_EEPROM_ */
 
-  block[0] = RtrDisabled;
-  block[1] = CANopenOpStateInit;
-  block[2] = CanBusOffMaxCnt;
-
-  return( storage_write_block( STORE_CAN, CAN_STORE_SIZE, block ) );
+  return CanBusOffBackoff;
 }
 
 /* ------------------------------------------------------------------------ */
 
-static void can_load_config( void )
+BOOL can_set_sync_emg_threshold( BYTE cnt )
 {
-  BYTE block[CAN_STORE_SIZE];
-
-  /* Read the configuration from EEPROM, if any
-     (errors in reading this datablock are caught and
-      reported by functions in store.c...) */
-  if( storage_read_block( STORE_CAN, CAN_STORE_SIZE, block ) )
-    {
-      RtrDisabled        = block[0];
-      CANopenOpStateInit = block[1];
-      CanBusOffMaxCnt    = block[2];
-    }
-  else
-    {
-      /* No valid parameters in EEPROM: use defaults */
-      RtrDisabled        = FALSE;
-      CANopenOpStateInit = FALSE;
-      CanBusOffMaxCnt    = 5;
-    }
+  CanSyncEmgThreshold = cnt;
 
 #ifdef _VARS_IN_EEPROM_
-  /* Create working copies of configuration globals in EEPROM */
-  if( eeprom_read( EE_RTR_DISABLED ) != RtrDisabled )
-    eeprom_write( EE_RTR_DISABLED, RtrDisabled );
-  if( eeprom_read( EE_CANOPEN_OPSTATE_INIT ) != CANopenOpStateInit )
-    eeprom_write( EE_CANOPEN_OPSTATE_INIT, CANopenOpStateInit );
-  if( eeprom_read( EE_CAN_BUSOFF_MAXCNT ) != CanBusOffMaxCnt )
-    eeprom_write( EE_CAN_BUSOFF_MAXCNT, CanBusOffMaxCnt );
+  if( eeprom_read( EE_CAN_SYNC_EMG_THRESHOLD ) != CanSyncEmgThreshold )
+    eeprom_write( EE_CAN_SYNC_EMG_THRESHOLD, CanSyncEmgThreshold );
 #endif /* _VARS_IN_EEPROM_ */
+
+  return TRUE;
 }
 
 /* ------------------------------------------------------------------------ */
-/* CAN INT interrupt handler */
-
-#pragma interrupt_handler canint_handler:3
 
-void canint_handler( void )
+BYTE can_get_sync_emg_threshold( void )
 {
-  BYTE object_no;
+#ifdef _VARS_IN_EEPROM_
+  CanSyncEmgThreshold = eeprom_read( EE_CAN_SYNC_EMG_THRESHOLD );
+#endif /* _VARS_IN_EEPROM_ */
 
-  object_no = can_check_for_msgs();
+  return CanSyncEmgThreshold;
+}
 
-  if( object_no != NO_OBJECT )
-    {
-      /* CAN message received: copy it to the CAN message buffer */
-      BYTE        cntr;
-      BYTE        index;
-      BYTE        *msg;
-      BYTE        dlc;
-      signed char byt;
-
-      cntr = get_buf_cntr();
-
-      /* If buffer is full (keep one buffer 'free', it might be the one
-	 currently being processed by the application, and since the data
-	 bytes are not copied they should not be overwritten yet; also the
-	 buffer space is used for assembling a reply, by the SDO server),
-	 disable further interrupts to prevent overwriting message buffers */
-      if( cntr == CAN_BUFS-1 )
-	{
-	  CAN_INT_DISABLE();
+/* ------------------------------------------------------------------------ */
 
-	  /* A message is lost: get it reported; also because the interrupt
-	     has been disabled more messages might get lost! */
-	  CanBufFull = TRUE;
+BOOL can_set_baudrate_sel( BYTE baudrate )
+{
+  /* Takes effect at the next CAN-controller (re)initialisation,
+     provided the CAN configuration parameters have been stored */
+  if( baudrate >= CAN_BAUDRATES && baudrate != CAN_BAUDRATE_JUMPERS )
+    {
+#ifdef _CAN_AUTOBAUD_
+      if( baudrate != CAN_BAUDRATE_AUTO )
+#endif /* _CAN_AUTOBAUD_ */
+	return FALSE;
+    }
 
-	  return;
-	}
+  CanBaudrateSel = baudrate;
 
-      /* Calculate index (of first empty buffer) from the 'done-reading-until'
-	 index (MsgOutIndex_) and the 'number-of-full-buffers' counter
-	 (MsgCounter_) parameters, which are stored in a fault-tolerant way
-	 (3 copies of each parameter, majority voting mechanism) */
-      index = (get_buf_index() + cntr) & CAN_BUFS_MASK;
+#ifdef _VARS_IN_EEPROM_
+  if( eeprom_read( EE_CAN_BAUDRATE_SEL ) != CanBaudrateSel )
+    eeprom_write( EE_CAN_BAUDRATE_SEL, CanBaudrateSel );
+#endif /* _VARS_IN_EEPROM_ */
 
-      /* Location to copy CAN message to */
-      msg = CanMsgBuf[index];
+  return TRUE;
+}
 
-      /* Get received DLC */
-      if( object_no > C91_MSG_BUFFERS-1 )
-	{
-	  dlc = 0; /* These object_no values are reserved for RTRs */
-	}
-      else
-	{
-	  BYTE addr;
-
-	  dlc = (can_read_reg( C91_DR00_I+1+(object_no<<1) ) &
-		 C91_DR_DLC_MASK);
-
-	  /* Read the data bytes from the message buffer;
-	     NB: always read the 8th databyte to guarantee a reload of
-	     the message buffer to the Shadow Register !!!
-	     If 2 messages with the same COB-ID arrive one after the other and
-	     have less than 8 bytes, then the second 'read' would otherwise
-	     *NOT* result in the new databytes !!!) */
-
-	  /* Determine object's message buffer address in CAN-controller */
-	  addr = C91_MSGS_I + (object_no * C91_MSG_SIZE);
-
-	  /* Force transfer to Shadow Register */
-	  if( dlc < 8 )
-	    can_read_reg( addr + 7 );
-	  else
-	    dlc = 8;
-
-	  /* Copy data bytes */
-	  addr += (dlc-1);
-	  for( byt=dlc-1; byt>=0; --byt,--addr ) msg[byt] = can_read_reg(addr);
-	}
+/* ------------------------------------------------------------------------ */
 
-      /* Store Object ID, DLC and mark buffer as 'not empty' */
-      msg[MSG_OBJECT_I] = object_no;
-      msg[MSG_DLC_I]    = dlc;
-      msg[MSG_VALID_I]  = BUF_NOT_EMPTY;
+BYTE can_get_baudrate_sel( void )
+{
+#ifdef _VARS_IN_EEPROM_
+  CanBaudrateSel = eeprom_read( EE_CAN_BAUDRATE_SEL );
+#endif /* _VARS_IN_EEPROM_ */
 
-      /* Increment the CAN-message-in-buffer counter */
-      ++cntr;
-      MsgCounter1 = cntr;  MsgCounter2 = cntr;  MsgCounter3 = cntr;
-    }
+  return CanBaudrateSel;
 }
 
 /* ------------------------------------------------------------------------ */
 
-static BYTE can_check_for_msgs( void )
+BYTE can_get_baudrate( void )
 {
-  BYTE object_no, bitmask;
+  /* Baudrate in use (BAUD50K, BAUD500K, etc.) */
+  return CanBaudrate;
+}
 
-  /* Each time 'can_check_for_msgs()') is called
-     'ObjectMask1' and 'ObjectMask2' are updated */
+/* ------------------------------------------------------------------------ */
 
-  /* Check Receive-Ready register 1 */
-  ObjectMask1 |= can_read_reg( C91_RECV_READY1_I );
+UINT16 can_get_bitrate_kbps( void )
+{
+  return CAN_BITRATE_KBPS[CanBaudrate];
+}
 
-  /* There is at least one message in buffers 0-7 received
-     and/or still to be handled */
-  if( ObjectMask1 != 0 )
-    {
-      bitmask = 0x01;
-      for( object_no=0; object_no<C91_MSG_BUFFERS_PER_RRR; ++object_no )
-	{
-	  if( ObjectMask1 & bitmask )
-	    {
-	      /* Clear the bit in the Receive Ready register */
-	      can_write_reg( C91_RECV_READY1_I, ~bitmask );
+/* ------------------------------------------------------------------------ */
 
-	      /* Reset the RI interrupt bit (if possible) */
-	      // ###Not necessary ?
-	      //can_write_reg( C91_INTERRUPT_I, (BYTE)(~C91_RECV_INT) );
+BYTE can_get_baudrate_src( void )
+{
+  /* How the baudrate in use was selected (CAN_BAUDRATE_BY_JUMPERS, etc.) */
+  return CanBaudrateSrc;
+}
+
+/* ------------------------------------------------------------------------ */
+
+UINT16 can_get_sync_dropped( void )
+{
+  UINT16 cnt;
+
+  /* Number of SYNCs dropped because the previous one was still pending
+     (saturates at 0xFFFF) */
+  CAN_INT_DISABLE();
+  cnt = CanSyncDroppedCnt;
+  CAN_INT_ENABLE();
+
+  return cnt;
+}
 
-	      /* Clear the bit in 'ObjectMask1' */
-	      ObjectMask1 &= ~bitmask;
+/* ------------------------------------------------------------------------ */
 
-	      /* Remote Transmission Requests require extra work... */
-	      if( object_no == C91_RTR )
-		{
-		  BYTE id_lo, id_hi;
+void can_sync_dropped_reset( void )
+{
+  CAN_INT_DISABLE();
+  CanSyncDroppedCnt  = 0;
+  CanSyncReportedCnt = 0;
+  CAN_INT_ENABLE();
+}
 
-		  /* Check if RTR received is for this node */
+/* ------------------------------------------------------------------------ */
 
-		  id_lo = can_read_reg( C91_DR00_I+(2*C91_RTR)+1 );
+/* Up to 16 bytes of configuration parameters can be stored
+   (earlier versions stored fewer: 3 bytes without CanBusOffBackoff,
+   4 bytes without CanSyncEmgThreshold, 5 bytes without CanBaudrateSel) */
+#define CAN_STORE_SIZE     6
+#define CAN_STORE_SIZE_MIN 3
+
+/* ------------------------------------------------------------------------ */
+
+BOOL can_store_config( void )
+{
+  BYTE block[CAN_STORE_SIZE];
 
 #ifdef _VARS_IN_EEPROM_
-		  /* ### Not in interrupt routine */
-		  //RtrIdLo = eeprom_read( EE_RTRIDLO );
-#endif
-		  if( (id_lo &
-		       (NODEID_MASK_LOW_BYTE | C91_DR_RTR_MASK)) == RtrIdLo )
-		    {
-		      id_hi = can_read_reg( C91_DR00_I+(2*C91_RTR) );
+  RtrDisabled        = eeprom_read( EE_RTR_DISABLED );
+  CANopenOpStateInit = eeprom_read( EE_CANOPEN_OPSTATE_INIT );
+  CanBusOffMaxCnt    = eeprom_read( EE_CAN_BUSOFF_MAXCNT );
+  CanBusOffBackoff   = eeprom_read( EE_CAN_BUSOFF_BACKOFF );
+  CanSyncEmgThreshold = eeprom_read( EE_CAN_SYNC_EMG_THRESHOLD );
+  CanBaudrateSel     = eeprom_read( EE_CAN_BAUDRATE_SEL );
+#endif /* _VARS_IN_EEPROM_ */
+
+  block[0] = RtrDisabled;
+  block[1] = CANopenOpStateInit;
+  block[2] = CanBusOffMaxCnt;
+  block[3] = CanBusOffBackoff;
+  block[4] = CanSyncEmgThreshold;
+  block[5] = CanBaudrateSel;
+
+  return( storage_write_block( STORE_CAN, CAN_STORE_SIZE, block ) );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_load_config( void )
+{
+  BYTE block[CAN_STORE_SIZE];
+  BYTE size;
+
+  /* Defaults, for parameters not found in EEPROM */
+  RtrDisabled         = FALSE;
+  CANopenOpStateInit  = FALSE;
+  CanBusOffMaxCnt     = 5;
+  CanBusOffBackoff    = 0;
+  CanSyncEmgThreshold = 0;
+  CanBaudrateSel      = CAN_BAUDRATE_JUMPERS;
+
+  /* Read the configuration from EEPROM, if any, possibly stored
+     by an earlier version (fewer parameters)
+     (errors in reading this datablock are caught and
+      reported by functions in store.c...) */
+  for( size=CAN_STORE_SIZE; size>=CAN_STORE_SIZE_MIN; --size )
+    if( storage_read_block( STORE_CAN, size, block ) ) break;
+
+  if( size >= CAN_STORE_SIZE_MIN )
+    {
+      RtrDisabled        = block[0];
+      CANopenOpStateInit = block[1];
+      CanBusOffMaxCnt    = block[2];
+      if( size > 3 && block[3] <= CAN_BUSOFF_BACKOFF_MAX )
+	CanBusOffBackoff = block[3];
+      if( size > 4 )
+	CanSyncEmgThreshold = block[4];
+      if( size > 5 && block[5] < CAN_BAUDRATES )
+	CanBaudrateSel = block[5];
+#ifdef _CAN_AUTOBAUD_
+      if( size > 5 && block[5] == CAN_BAUDRATE_AUTO )
+	CanBaudrateSel = block[5];
+#endif /* _CAN_AUTOBAUD_ */
+    }
 
 #ifdef _VARS_IN_EEPROM_
-		      /* ### Not in interrupt routine */
-		      //RtrIdHi = eeprom_read( EE_RTRIDHI );
-#endif
-		      if( (id_hi & NODEID_MASK_HIGH_BYTE) == RtrIdHi )
-			{
-			  /* Okay, this is an RTR for me;
-			     find out which object is requested... */
-
-			  id_hi &= OBJECT_MASK;
-
-			  switch( id_hi )
-			    {
-			    case TPDO1_OBJ:
-			      return C91_TPDO1_RTR;
-			    case TPDO2_OBJ:
-			      return C91_TPDO2_RTR;
-			    case TPDO3_OBJ:
-			      return C91_TPDO3_RTR;
-			    case TPDO4_OBJ:
-			      return C91_TPDO4_RTR;
-			    case NODEGUARD_OBJ:
-			      return C91_NODEGUARD_RTR;
-			    default:
-			      /* Don't service this message */
-			      return NO_OBJECT;
-			    }
-			}
-		      else
-			{
-			  /* Don't service this message */
-			  return NO_OBJECT;
-			}
-		    }
-		  else
-		    {
-		      /* Don't service this message */
-		      return NO_OBJECT;
-		    }
-		}
-	      else
-		{
-		  /* This corresponds to the message buffer number
-		     containing a message to service */
-		  return object_no;
-		}
-	    }
-	  bitmask <<= 1;
-	}
+  /* Create working copies of configuration globals in EEPROM */
+  if( eeprom_read( EE_RTR_DISABLED ) != RtrDisabled )
+    eeprom_write( EE_RTR_DISABLED, RtrDisabled );
+  if( eeprom_read( EE_CANOPEN_OPSTATE_INIT ) != CANopenOpStateInit )
+    eeprom_write( EE_CANOPEN_OPSTATE_INIT, CANopenOpStateInit );
+  if( eeprom_read( EE_CAN_BUSOFF_MAXCNT ) != CanBusOffMaxCnt )
+    eeprom_write( EE_CAN_BUSOFF_MAXCNT, CanBusOffMaxCnt );
+  if( eeprom_read( EE_CAN_BUSOFF_BACKOFF ) != CanBusOffBackoff )
+    eeprom_write( EE_CAN_BUSOFF_BACKOFF, CanBusOffBackoff );
+  if( eeprom_read( EE_CAN_SYNC_EMG_THRESHOLD ) != CanSyncEmgThreshold )
+    eeprom_write( EE_CAN_SYNC_EMG_THRESHOLD, CanSyncEmgThreshold );
+  if( eeprom_read( EE_CAN_BAUDRATE_SEL ) != CanBaudrateSel )
+    eeprom_write( EE_CAN_BAUDRATE_SEL, CanBaudrateSel );
+#endif /* _VARS_IN_EEPROM_ */
+}
+
+#ifdef _SPI_STATS_
+/* ------------------------------------------------------------------------ */
+
+BOOL can_spi_stats_get( BYTE cnt_type, BYTE subind, BYTE *nbytes, BYTE *par )
+{
+  UINT32 cntr;
+
+  if( cnt_type >= SPI_CNT_TYPES ) return FALSE;
+
+  if( subind == OD_NO_OF_ENTRIES )
+    {
+      /* Number of call sites */
+      par[0]  = SPI_SITES;
+      *nbytes = 1;  /* Significant bytes < 4 */
+      return TRUE;
     }
 
-  /* Check Receive-Ready register 2 */
-  ObjectMask2 |= can_read_reg( C91_RECV_READY2_I );
+  if( subind > SPI_SITES ) return FALSE;
 
-  /* There is at least one message in buffers 8-15 received
-     and/or still to be handled */
-  if( ObjectMask2 != 0 )
+  /* Subindex 1 corresponds to call site 0, etc. */
+  --subind;
+
+  /* Need undisturbed access: the interrupt routine updates the counters */
+  CAN_INT_DISABLE();
+  switch( cnt_type )
     {
-      bitmask = 0x01;
-      for( object_no=0; object_no<C91_MSG_BUFFERS_PER_RRR; ++object_no )
+    case SPI_CNT_READS:
+      cntr = SpiReads[subind];
+      break;
+    case SPI_CNT_WRITES:
+      cntr = SpiWrites[subind];
+      break;
+    default:
+      cntr = SpiClocks[subind];
+      break;
+    }
+  CAN_INT_ENABLE();
+
+  par[0] = (BYTE) (cntr & 0x000000FF);
+  par[1] = (BYTE) ((cntr & 0x0000FF00) >> 8);
+  par[2] = (BYTE) ((cntr & 0x00FF0000) >> 16);
+  par[3] = (BYTE) ((cntr & 0xFF000000) >> 24);
+  *nbytes = 4;
+
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_spi_stats_reset( void )
+{
+  BYTE site;
+
+  CAN_INT_DISABLE();
+  for( site=0; site<SPI_SITES; ++site )
+    {
+      SpiReads[site]  = 0L;
+      SpiWrites[site] = 0L;
+      SpiClocks[site] = 0L;
+    }
+  CAN_INT_ENABLE();
+}
+#endif /* _SPI_STATS_ */
+
+#ifdef _CAN_STATS_
+/* ------------------------------------------------------------------------ */
+
+BOOL can_stats_get( BYTE subind, BYTE *nbytes, BYTE *par )
+{
+  UINT32 val;
+
+  /* Need undisturbed access: the interrupt routine updates the statistics */
+  CAN_INT_DISABLE();
+  switch( subind )
+    {
+    case OD_NO_OF_ENTRIES:
+      val = CAN_STATS_ENTRIES;
+      break;
+    case CAN_STATS_ISR_CNT:
+      val = CanIsrCnt;
+      break;
+    case CAN_STATS_ISR_AVG:
+      if( CanIsrCnt == 0L )
+	val = 0L;
+      else
+	val = (CanIsrTicks / CanIsrCnt) * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_ISR_MAX:
+      val = (UINT32) CanIsrTicksMax * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_HIGH_WATER:
+      val = CanBufHighWater;
+      break;
+    case CAN_STATS_LATENCY_AVG:
+      val = can_stats_lat_avg( CAN_LAT_ALL );
+      break;
+    case CAN_STATS_LATENCY_MAX:
+      val = (UINT32) CanLatTicksMax[CAN_LAT_ALL] * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_OVERRUNS:
+      val = CanOverrunCnt;
+      break;
+    case CAN_STATS_FRAMES:
+      val = CanFrameCnt;
+      break;
+    case CAN_STATS_PRIO_LATENCY_MAX:
+      val = (UINT32) CanPrioLatTicksMax * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_TX_DROPS:
+      val = CanTxDropCnt;
+      break;
+    case CAN_STATS_TXQ_HIGH_WATER:
+      val = CanTxQHighWater;
+      break;
+    case CAN_STATS_RPDO_FAST_CNT:
+      val = CanRpdoFastCnt;
+      break;
+    case CAN_STATS_RPDO_FAST_MAX:
+      val = (UINT32) CanRpdoFastMax * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_SYNC_LATENCY_AVG:
+      val = can_stats_lat_avg( CAN_LAT_SYNC );
+      break;
+    case CAN_STATS_SYNC_LATENCY_MAX:
+      val = (UINT32) CanLatTicksMax[CAN_LAT_SYNC] * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_RPDO_LATENCY_AVG:
+      val = can_stats_lat_avg( CAN_LAT_RPDO );
+      break;
+    case CAN_STATS_RPDO_LATENCY_MAX:
+      val = (UINT32) CanLatTicksMax[CAN_LAT_RPDO] * T3_MUS_PER_TICK;
+      break;
+    case CAN_STATS_SDO_LATENCY_AVG:
+      val = can_stats_lat_avg( CAN_LAT_SDO );
+      break;
+    case CAN_STATS_SDO_LATENCY_MAX:
+      val = (UINT32) CanLatTicksMax[CAN_LAT_SDO] * T3_MUS_PER_TICK;
+      break;
+    default:
+      CAN_INT_ENABLE();
+      return FALSE;
+    }
+  CAN_INT_ENABLE();
+
+  can_stats_put( val, nbytes, par );
+  if( subind == OD_NO_OF_ENTRIES ) *nbytes = 1;
+
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_stats_reset( void )
+{
+  BYTE type;
+
+  CAN_INT_DISABLE();
+  CanIsrCnt       = 0L;
+  CanIsrTicks     = 0L;
+  CanFrameCnt     = 0L;
+  CanIsrTicksMax  = 0;
+  CanBufHighWater = 0;
+  for( type=0; type<CAN_LAT_TYPES; ++type )
+    {
+      CanMsgCnt[type]      = 0L;
+      CanLatTicks[type]    = 0L;
+      CanLatTicksMax[type] = 0;
+    }
+  CanPrioLatTicksMax = 0;
+  CanOverrunCnt   = 0;
+  CanTxDropCnt    = 0;
+  CanTxQHighWater = 0;
+  CanRpdoFastCnt  = 0L;
+  CanRpdoFastMax  = 0;
+  CAN_INT_ENABLE();
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_stats_latency( BYTE type, UINT16 ticks )
+{
+  /* Account for the time a message of the given type spent in the buffer
+     (called by the main loop only) */
+  if( ticks > CanLatTicksMax[type] ) CanLatTicksMax[type] = ticks;
+  if( CanMsgCnt[type] != 0xFFFFFFFF &&
+      CanLatTicks[type] <= 0xFFFFFFFF - (UINT32) ticks )
+    {
+      CanLatTicks[type] += (UINT32) ticks;
+      ++CanMsgCnt[type];
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+static UINT32 can_stats_lat_avg( BYTE type )
+{
+  /* Average time in the buffer, in microseconds */
+  if( CanMsgCnt[type] == 0L ) return 0L;
+  return( (CanLatTicks[type] / CanMsgCnt[type]) * T3_MUS_PER_TICK );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_stats_isr_done( UINT16 t_start )
+{
+  /* Account for the time spent in the CAN INT interrupt routine */
+  UINT16 ticks;
+
+  ticks = timer3_read() - t_start;
+  if( ticks > CanIsrTicksMax ) CanIsrTicksMax = ticks;
+  if( CanIsrCnt != 0xFFFFFFFF &&
+      CanIsrTicks <= 0xFFFFFFFF - (UINT32) ticks )
+    {
+      CanIsrTicks += (UINT32) ticks;
+      ++CanIsrCnt;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_stats_put( UINT32 val, BYTE *nbytes, BYTE *par )
+{
+  par[0] = (BYTE) (val & 0x000000FF);
+  par[1] = (BYTE) ((val & 0x0000FF00) >> 8);
+  par[2] = (BYTE) ((val & 0x00FF0000) >> 16);
+  par[3] = (BYTE) ((val & 0xFF000000) >> 24);
+  *nbytes = 4;
+}
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+/* ------------------------------------------------------------------------ */
+
+BYTE can_traffic_read_seg( BYTE data[7], BYTE *nbytes, BOOL first_segment )
+{
+  /* Deliver the traffic record in segments of up to 7 bytes;
+     the record is copied in one go at the first segment */
+  BYTE i;
+
+  if( first_segment )
+    {
+      BYTE   *rec;
+      UINT32 bits;
+      UINT16 val;
+
+      rec = CanTrafficSnapshot;
+
+      /* Need undisturbed access: the interrupt routine updates counters */
+      CAN_INT_DISABLE();
+
+      can_traffic_window();
+
+      for( i=0; i<C91_MSG_BUFFERS; ++i )
 	{
-	  if( ObjectMask2 & bitmask )
-	    {
-	      /* Clear the bit in the Receive Ready register */
-	      can_write_reg( C91_RECV_READY2_I, ~bitmask );
+	  rec[0] = (BYTE) (CanRxCnt[i] & 0x00FF);
+	  rec[1] = (BYTE) ((CanRxCnt[i] & 0xFF00) >> 8);
+	  rec += 2;
+	}
+      for( i=0; i<C91_MSG_BUFFERS; ++i )
+	{
+	  rec[0] = (BYTE) (CanTxCnt[i] & 0x00FF);
+	  rec[1] = (BYTE) ((CanTxCnt[i] & 0xFF00) >> 8);
+	  rec += 2;
+	}
+      rec[0] = (BYTE) (CanWarningCnt & 0x00FF);
+      rec[1] = (BYTE) ((CanWarningCnt & 0xFF00) >> 8);
+      rec[2] = (BYTE) (CanErrPassiveCnt & 0x00FF);
+      rec[3] = (BYTE) ((CanErrPassiveCnt & 0xFF00) >> 8);
+      rec[4] = (BYTE) (CanBusOffIntCnt & 0x00FF);
+      rec[5] = (BYTE) ((CanBusOffIntCnt & 0xFF00) >> 8);
+      rec[6] = (BYTE) (CanTransmCheckCnt & 0x00FF);
+      rec[7] = (BYTE) ((CanTransmCheckCnt & 0xFF00) >> 8);
+      rec += 8;
+
+      /* Bits in the complete slots (all but the current one) */
+      bits = 0L;
+      for( i=0; i<CAN_SHARE_SLOTS; ++i )
+	if( i != CanShareSlot ) bits += CanShareBits[i];
+
+      CAN_INT_ENABLE();
 
-	      /* Reset the RI interrupt bit (if possible) */
-	      // ###Not necessary ?
-	      //can_write_reg( C91_INTERRUPT_I, (BYTE)(~C91_RECV_INT) );
+      /* Traffic share in 0.1 percent:
+	 bits / (seconds * kbit/s * 1000) * 1000 */
+      bits /= ((UINT32) (CAN_SHARE_SLOTS-1) *
+	       (UINT32) CAN_BITRATE_KBPS[CanBaudrate]);
+      if( bits > 1000L ) bits = 1000L;
+      val = (UINT16) bits;
+      rec[0] = (BYTE) (val & 0x00FF);
+      rec[1] = (BYTE) ((val & 0xFF00) >> 8);
 
-	      /* Clear the bit in 'ObjectMask2' */
-	      ObjectMask2 &= ~bitmask;
+      val = CAN_BITRATE_KBPS[CanBaudrate];
+      rec[2] = (BYTE) (val & 0x00FF);
+      rec[3] = (BYTE) ((val & 0xFF00) >> 8);
 
-	      /* This corresponds to the message buffer number
-		 containing a message to service */
-	      return( C91_MSG_BUFFERS_PER_RRR + object_no );
-	    }
-	  bitmask <<= 1;
+      rec[4] = CAN_SHARE_SLOTS-1;
+
+      CanTrafficIndex = 0;
+    }
+
+  if( CanTrafficIndex >= CAN_TRAFFIC_SIZE ) return SDO_ECODE_PAR_ILLEGAL;
+
+  if( CAN_TRAFFIC_SIZE - CanTrafficIndex > 7 )
+    *nbytes = 7;
+  else
+    *nbytes = CAN_TRAFFIC_SIZE - CanTrafficIndex;
+
+  for( i=0; i<*nbytes; ++i, ++CanTrafficIndex )
+    data[i] = CanTrafficSnapshot[CanTrafficIndex];
+
+  return SDO_ECODE_OKAY;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void can_traffic_reset( void )
+{
+  BYTE i;
+
+  CAN_INT_DISABLE();
+  for( i=0; i<C91_MSG_BUFFERS; ++i )
+    {
+      CanRxCnt[i] = 0;
+      CanTxCnt[i] = 0;
+    }
+  CanWarningCnt     = 0;
+  CanErrPassiveCnt  = 0;
+  CanBusOffIntCnt   = 0;
+  CanTransmCheckCnt = 0;
+  for( i=0; i<CAN_SHARE_SLOTS; ++i ) CanShareBits[i] = 0L;
+  CAN_INT_ENABLE();
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_traffic_account( BYTE object_no, BYTE dlc, BOOL transmit )
+{
+  /* Called with the CAN INT interrupt disabled (or from the interrupt) */
+
+  /* RTRs are received in buffer C91_RTR */
+  if( object_no > C91_MSG_BUFFERS-1 ) object_no = C91_RTR;
+
+  if( transmit )
+    ++CanTxCnt[object_no];
+  else
+    ++CanRxCnt[object_no];
+
+  can_traffic_window();
+  CanShareBits[CanShareSlot] += CAN_FRAME_BITS( dlc );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_traffic_window( void )
+{
+  /* Move the traffic share window along by the number of seconds passed
+     since the previous call (called with the CAN INT interrupt disabled) */
+  BYTE secs, elapsed;
+
+  secs    = CanTrafficSecs;
+  elapsed = secs - CanTrafficSecsLast;
+  CanTrafficSecsLast = secs;
+
+  if( elapsed > CAN_SHARE_SLOTS ) elapsed = CAN_SHARE_SLOTS;
+  while( elapsed > 0 )
+    {
+      CanShareSlot = (CanShareSlot + 1) & CAN_SHARE_SLOTS_MASK;
+      CanShareBits[CanShareSlot] = 0L;
+      --elapsed;
+    }
+}
+#endif /* _CAN_TRAFFIC_ */
+
+/* ------------------------------------------------------------------------ */
+/* CAN INT interrupt handler */
+
+#pragma interrupt_handler canint_handler:3
+
+void canint_handler( void )
+{
+  BYTE object_no, budget;
+#ifdef _SPI_STATS_
+  BYTE spi_site;
+#endif
+
+#ifdef _CAN_STATS_
+  CanIsrStart = timer3_read();
+#endif /* _CAN_STATS_ */
+
+  SPI_SITE_ENTER( SPI_SITE_INTERRUPT );
+
+  /* Copy all received messages to the CAN message buffer in one go,
+     but not more than a preset number, to limit the time spent here
+     (if more are pending the (level-triggered) interrupt occurs again) */
+  for( budget=CAN_INT_BUDGET; budget>0; --budget )
+    {
+      object_no = can_check_for_msgs();
+
+      if( object_no == NO_OBJECT )
+	{
+	  /* Nothing (more) to service ? */
+	  if( ObjectMask1 == 0 && ObjectMask2 == 0 ) break;
+
+	  /* An RTR that is not for this node: continue with the rest */
+	  continue;
 	}
+
+      /* Stop when the buffer is full */
+      if( can_buffer_msg( object_no ) == FALSE ) break;
     }
 
-  /* No message to service */
-  return NO_OBJECT;
+  /* Refill transmit buffers from their queues, if any was sent */
+  if( CanIntMask & C91_TRANSM_INT )
+    if( can_read_reg( C91_INTERRUPT_I ) & C91_TRANSM_INT )
+      can_txq_refill();
+
+#ifdef _CAN_STATS_
+  can_stats_isr_done( CanIsrStart );
+#endif /* _CAN_STATS_ */
+
+  SPI_SITE_LEAVE();
 }
 
 /* ------------------------------------------------------------------------ */
 
-static BYTE get_buf_index( void )
+static BOOL can_buffer_msg( BYTE object_no )
 {
-  /* Majority voting */
-  if( MsgOutIndex1 == MsgOutIndex2 ) MsgOutIndex3 = MsgOutIndex1;
-  else if( MsgOutIndex1 == MsgOutIndex3 ) MsgOutIndex2 = MsgOutIndex1;
-  else if( MsgOutIndex2 == MsgOutIndex3 ) MsgOutIndex1 = MsgOutIndex3;
+  /* CAN message received: copy it to the CAN message buffer;
+     returns FALSE if the buffer is full */
+  BYTE lane;
+  BYTE cntr;
+  BYTE index;
+  BYTE out_index;
+  BYTE *msg;
+  BYTE dlc;
+
+#ifdef _RPDO_FAST_
+  /* An RPDO with a 'fast' handler is handled right here
+     (but only when it would be handled at all: in state Operational,
+     and no NMT message that may change the state is waiting for the
+     main loop), it does not go to the buffer (so is not seen by
+     the main loop) */
+  if( object_no >= C91_RPDO1 && object_no <= C91_RPDO4 &&
+      NodeState == NMT_OPERATIONAL && CanNmtInCnt == CanNmtOutCnt &&
+      rpdo_fast_enabled( object_no - C91_RPDO1 ) )
+    {
+      can_rpdo_fast( object_no );
+      return TRUE;
+    }
+#endif /* _RPDO_FAST_ */
+
+  /* NMT, SYNC and RTRs go to the priority lane, the rest to the bulk lane */
+  if( object_no == C91_NMT || object_no == C91_SYNC ||
+      object_no > C91_MSG_BUFFERS-1 )
+    lane = CAN_LANE_PRIO;
   else
+    lane = CAN_LANE_BULK;
+
+  /* Calculate the number of messages in the lane from the index of the
+     first empty buffer (MsgInIndex) and the 'done-reading-until' index
+     (MsgOutIndex), which are stored in a fault-tolerant way
+     (3 copies of each parameter, majority voting mechanism) */
+  index     = get_in_index( lane );
+  out_index = PROT_PEEK( &MsgOutIndex[lane] );
+  cntr      = (index - out_index) & (CAN_LANE_BUFS[lane]-1);
+
+  /* Keep at most one SYNC in the buffer: drop this one if the previous
+     one has not been handled yet (it can't be there if the lane is empty,
+     whatever CanSyncPending says), but give the pending one the time
+     of reception of this latest SYNC */
+  if( object_no == C91_SYNC )
     {
-      /* All 3 are different: do a majority vote on a bit-by-bit basis... */
-      BYTE byt, bitmask, bits, i;
-      byt     = 0x00; /* Start value */
-      bitmask = 0x80; /* Start with MSB */
-      for( i=0; i<8; ++i )
+      if( (CanSyncPending & TRUE) == TRUE && cntr > 0 )
 	{
-	  bits = 0;
-	  if( MsgOutIndex1 & bitmask ) ++bits;
-	  if( MsgOutIndex2 & bitmask ) ++bits;
-	  if( MsgOutIndex3 & bitmask ) ++bits;
-	  byt <<= 1; /* Shift value one bit up*/
-	  /* Bit is set or not */
-	  if( bits > 1 ) ++byt; /* 2 or 3 of the bits (majority) are set */
-	  bitmask >>= 1; /* Next bit to check */
+#ifndef _ELMB103_
+	  can_buffer_tstamp( get_buf( CAN_LANE_PRIO, CanSyncIndex ) );
+#endif /* _ELMB103_ */
+	  if( CanSyncDroppedCnt != 0xFFFF ) ++CanSyncDroppedCnt;
+#ifdef _CAN_TRAFFIC_
+	  can_traffic_account( object_no, 0, FALSE );
+#endif /* _CAN_TRAFFIC_ */
+	  return TRUE;
 	}
-      /* Set the new MsgOutIndex1/2/3 value */
-      MsgOutIndex1 = byt;  MsgOutIndex2 = byt;  MsgOutIndex3 = byt;
     }
-  return MsgOutIndex1;
+
+  /* If buffer is full (keep one buffer 'free', it might be the one
+     currently being processed by the application, and since the data
+     bytes are not copied they should not be overwritten yet; also the
+     buffer space is used for assembling a reply, by the SDO server),
+     disable further interrupts to prevent overwriting message buffers */
+  if( cntr == CAN_LANE_BUFS[lane]-1 )
+    {
+      CAN_INT_DISABLE();
+
+      /* A message is lost: get it reported; also because the interrupt
+	 has been disabled more messages might get lost! */
+      CanBufFull = TRUE;
+
+#ifdef _CAN_STATS_
+      if( CanOverrunCnt != 0xFFFF ) ++CanOverrunCnt;
+#endif /* _CAN_STATS_ */
+
+      return FALSE;
+    }
+
+  /* Location to copy CAN message to */
+  msg = get_buf( lane, index );
+
+  /* Get received DLC and data bytes */
+  dlc = can_read_msg_data( object_no, msg );
+
+  /* Store Object ID, DLC and mark buffer as 'not empty' */
+  msg[MSG_OBJECT_I] = object_no;
+  msg[MSG_DLC_I]    = dlc;
+  msg[MSG_VALID_I]  = BUF_NOT_EMPTY;
+
+#ifndef _ELMB103_
+  /* Time of reception */
+  can_buffer_tstamp( msg );
+#endif /* _ELMB103_ */
+
+  if( object_no == C91_SYNC )
+    {
+      CanSyncPending = TRUE;
+#ifndef _ELMB103_
+      CanSyncIndex   = index;
+#endif /* _ELMB103_ */
+    }
+#ifdef _RPDO_FAST_
+  if( object_no == C91_NMT ) ++CanNmtInCnt;
+#endif /* _RPDO_FAST_ */
+
+  /* Increment the buffer(-in) index, which hands the message over
+     to the main loop (do this last!) */
+  index = (index + 1) & (CAN_LANE_BUFS[lane]-1);
+  prot_set( &MsgInIndex[lane], index );
+
+#ifdef _CAN_STATS_
+  ++cntr;
+  if( lane == CAN_LANE_BULK && cntr > CanBufHighWater )
+    CanBufHighWater = cntr;
+  if( CanFrameCnt != 0xFFFFFFFF ) ++CanFrameCnt;
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+  can_traffic_account( object_no, dlc, FALSE );
+#endif /* _CAN_TRAFFIC_ */
+
+  return TRUE;
 }
 
 /* ------------------------------------------------------------------------ */
 
-static BYTE get_buf_cntr( void )
+#ifndef _ELMB103_
+static void can_buffer_tstamp( BYTE *msg )
 {
-  /* Majority voting */
-  if( MsgCounter1 == MsgCounter2 ) MsgCounter3 = MsgCounter1;
-  else if( MsgCounter1 == MsgCounter3 ) MsgCounter2 = MsgCounter1;
-  else if( MsgCounter2 == MsgCounter3 ) MsgCounter1 = MsgCounter3;
+  /* Store the time of reception (Timer3) in a message buffer */
+  UINT16 t_recv;
+  t_recv = timer3_read();
+  msg[MSG_TSTAMP_I]   = (BYTE) (t_recv & 0x00FF);
+  msg[MSG_TSTAMP_I+1] = (BYTE) ((t_recv & 0xFF00) >> 8);
+}
+#endif /* _ELMB103_ */
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE can_read_msg_data( BYTE object_no, BYTE *buf )
+{
+  /* Copy the data bytes of a received message to 'buf[]' (8 bytes);
+     returns the DLC */
+  BYTE dlc;
+
+  if( object_no > C91_MSG_BUFFERS-1 )
+    {
+      dlc = 0; /* These object_no values are reserved for RTRs */
+    }
   else
     {
-      /* All 3 are different: do a majority vote on a bit-by-bit basis... */
-      BYTE byt, bitmask, bits, i;
-      byt     = 0x00; /* Start value */
-      bitmask = 0x80; /* Start with MSB */
-      for( i=0; i<8; ++i )
+      BYTE addr;
+
+      dlc = (can_read_reg( C91_DR00_I+1+(object_no<<1) ) &
+	     C91_DR_DLC_MASK);
+
+      /* Read the data bytes from the message buffer;
+	 NB: always read the 8th databyte to guarantee a reload of
+	 the message buffer to the Shadow Register !!!
+	 If 2 messages with the same COB-ID arrive one after the other and
+	 have less than 8 bytes, then the second 'read' would otherwise
+	 *NOT* result in the new databytes !!!) */
+
+      /* Determine object's message buffer address in CAN-controller */
+      addr = C91_MSGS_I + (object_no * C91_MSG_SIZE);
+
+      /* Force transfer to Shadow Register (always read byte 7 first) */
+      if( dlc > 8 ) dlc = 8;
+      buf[7] = can_read_reg( addr + 7 );
+
+      /* Copy the other data bytes (from the Shadow Register)
+	 in a single burst */
+      if( dlc == 8 )
+	can_read_burst( addr, 7, buf );
+      else if( dlc > 0 )
+	can_read_burst( addr, dlc, buf );
+    }
+  return dlc;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef _RPDO_FAST_
+static void can_rpdo_fast( BYTE object_no )
+{
+  /* Pass a received RPDO directly to its 'fast' handler
+     (see APP_RPDO_FAST[] in app.c for what such a handler may do) */
+  BYTE data[8];
+  BYTE dlc;
+
+  dlc = can_read_msg_data( object_no, data );
+
+  rpdo_fast( object_no - C91_RPDO1, dlc, data );
+
+  /* Reset the Life Guarding time-out counter (a message was received),
+     as done in the main loop for the other messages */
+  LifeGuardCntr = 0;
+
+#ifdef _CAN_STATS_
+  {
+    UINT16 ticks;
+    ticks = timer3_read() - CanIsrStart;
+    if( ticks > CanRpdoFastMax ) CanRpdoFastMax = ticks;
+    if( CanRpdoFastCnt != 0xFFFFFFFF ) ++CanRpdoFastCnt;
+  }
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+  can_traffic_account( object_no, dlc, FALSE );
+#endif /* _CAN_TRAFFIC_ */
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void can_nmt_done( void )
+{
+  /* The main loop is back for the next message, so it is done with
+     an NMT message returned by can_read() the previous time */
+  if( (CanNmtRead & TRUE) == TRUE )
+    {
+      CanNmtRead = FALSE;
+      ++CanNmtOutCnt;
+    }
+}
+#endif /* _RPDO_FAST_ */
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE can_check_for_msgs( void )
+{
+  BYTE prio, pending, object_no;
+  BYTE rr[2];
+
+  /* Each time 'can_check_for_msgs()' is called one message is selected
+     from 'ObjectMask1' and 'ObjectMask2' (the buffers with a message
+     still to be handled); only when these are empty the Receive-Ready
+     registers are read again (both in one go: they are adjacent) */
+  if( ObjectMask1 == 0 && ObjectMask2 == 0 )
+    {
+      can_read_burst( C91_RECV_READY1_I, 2, rr );
+      ObjectMask1 = rr[0];
+      ObjectMask2 = rr[1];
+
+      /* No message to service */
+      if( ObjectMask1 == 0 && ObjectMask2 == 0 ) return NO_OBJECT;
+    }
+
+  /* Select the buffer with the highest priority
+     (the lowest buffer number within a priority class) */
+  object_no = NO_OBJECT;
+  for( prio=0; prio<CAN_RECV_PRIOS; ++prio )
+    {
+      pending = ObjectMask1 & CAN_RECV_PRIO_MASK[prio][0];
+      if( pending )
 	{
-	  bits = 0;
-	  if( MsgCounter1 & bitmask ) ++bits;
-	  if( MsgCounter2 & bitmask ) ++bits;
-	  if( MsgCounter3 & bitmask ) ++bits;
-	  byt <<= 1; /* Shift value one bit up*/
-	  if( bits > 1 ) ++byt; /* 2 or 3 of the bits (majority) are set */
-	  bitmask >>= 1; /* Next bit to check */
+	  object_no = lowest_bit( pending );
+
+	  /* Clear the bit in the Receive Ready register */
+	  can_write_reg( C91_RECV_READY1_I, ~BIT(object_no) );
+
+	  /* Clear the bit in 'ObjectMask1' */
+	  ObjectMask1 &= ~BIT(object_no);
+	  break;
+	}
+
+      pending = ObjectMask2 & CAN_RECV_PRIO_MASK[prio][1];
+      if( pending )
+	{
+	  object_no = lowest_bit( pending );
+
+	  /* Clear the bit in the Receive Ready register */
+	  can_write_reg( C91_RECV_READY2_I, ~BIT(object_no) );
+
+	  /* Clear the bit in 'ObjectMask2' */
+	  ObjectMask2 &= ~BIT(object_no);
+
+	  object_no += C91_MSG_BUFFERS_PER_RRR;
+	  break;
 	}
-      /* Set the new MsgCounter1/2/3 value */
-      MsgCounter1 = byt;  MsgCounter2 = byt;  MsgCounter3 = byt;
     }
-  return MsgCounter1;
+
+  /* Remote Transmission Requests require extra work... */
+  if( object_no == C91_RTR ) return can_rtr_object();
+
+  /* This corresponds to the message buffer number
+     containing a message to service */
+  return object_no;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE can_rtr_object( void )
+{
+  /* Check if the RTR received (in buffer 0) is for this node,
+     and if so which object is requested */
+  BYTE id_lo, id_hi;
+
+  id_lo = can_read_reg( C91_DR00_I+(2*C91_RTR)+1 );
+
+#ifdef _VARS_IN_EEPROM_
+  /* ### Not in interrupt routine */
+  //RtrIdLo = eeprom_read( EE_RTRIDLO );
+#endif
+  if( (id_lo & (NODEID_MASK_LOW_BYTE | C91_DR_RTR_MASK)) != RtrIdLo )
+    {
+      /* Don't service this message */
+      return NO_OBJECT;
+    }
+
+  id_hi = can_read_reg( C91_DR00_I+(2*C91_RTR) );
+
+#ifdef _VARS_IN_EEPROM_
+  /* ### Not in interrupt routine */
+  //RtrIdHi = eeprom_read( EE_RTRIDHI );
+#endif
+  if( (id_hi & NODEID_MASK_HIGH_BYTE) != RtrIdHi )
+    {
+      /* Don't service this message */
+      return NO_OBJECT;
+    }
+
+  /* Okay, this is an RTR for me;
+     find out which object is requested... */
+
+  id_hi &= OBJECT_MASK;
+
+  switch( id_hi )
+    {
+    case TPDO1_OBJ:
+      return C91_TPDO1_RTR;
+    case TPDO2_OBJ:
+      return C91_TPDO2_RTR;
+    case TPDO3_OBJ:
+      return C91_TPDO3_RTR;
+    case TPDO4_OBJ:
+      return C91_TPDO4_RTR;
+    case NODEGUARD_OBJ:
+      return C91_NODEGUARD_RTR;
+    default:
+      /* Don't service this message */
+      return NO_OBJECT;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE lowest_bit( BYTE val )
+{
+  /* Number of the lowest bit set in 'val' (which must not be 0) */
+  if( val & 0x0F )
+    return LOWEST_BIT[val & 0x0F];
+  else
+    return( 4 + LOWEST_BIT[val >> 4] );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE *get_buf( BYTE lane, BYTE index )
+{
+  /* Address of message buffer 'index' in the given lane */
+  if( lane == CAN_LANE_PRIO )
+    return CanPrioMsgBuf[index];
+  else
+    return CanMsgBuf[index];
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE get_in_index( BYTE lane )
+{
+  /* To be called by the CAN INT interrupt routine only
+     (majority voting; corrects any bitflips) */
+  return( prot_get( &MsgInIndex[lane] ) & (CAN_LANE_BUFS[lane]-1) );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE get_out_index( BYTE lane )
+{
+  /* To be called by the main loop only
+     (majority voting; corrects any bitflips) */
+  return( prot_get( &MsgOutIndex[lane] ) & (CAN_LANE_BUFS[lane]-1) );
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE get_buf_cntr( BYTE lane )
+{
+  /* Number of messages in the lane, as seen by the main loop
+     (only the main loop's own index is corrected: the interrupt routine
+     may be changing MsgInIndex at any moment; should that happen
+     halfway, then the vote still results in the old or the new value) */
+  BYTE in_index;
+
+  in_index = PROT_PEEK( &MsgInIndex[lane] );
+
+  return( (in_index - get_out_index( lane )) & (CAN_LANE_BUFS[lane]-1) );
 }
 
 /* ------------------------------------------------------------------------ */
@@ -10,6 +10,18 @@ History: 19JAN.00; Henk B&B; First version.
 	                     moved rest to include file 81c91.h.
 	 09OCT.02; Henk B&B; Included "canopen.h": used where "can.h" is used.
 	   MAY.03; Henk B&B; Added receive message buffering under interrupt.
+	 16OCT.26; agent; Added optional SPI access accounting.
+	 16OCT.26; agent; Added optional receive statistics.
+	 16OCT.26; agent; Added optional traffic counters and traffic share.
+	 16OCT.26; agent; Added burst register access functions.
+	 16OCT.26; agent; can_write() returns a BOOL (transmit queues).
+	 16OCT.26; agent; Added Bus-off back-off configuration.
+	 16OCT.26; agent; Added SYNC coalescing counter and threshold.
+	 16OCT.26; agent; Added baudrate selection (overrules jumpers).
+	 16OCT.26; agent; Added baudrate-in-use functions (for the
+			  optional automatic baudrate detection).
+	 16OCT.26; agent; Added receive timestamp functions and
+			  per-type latency statistics.
 --------------------------------------------------------------------------- */
 
 #ifndef CAN_H
@@ -79,15 +91,25 @@ extern BYTE CANopenErrorReg;
 #define C91_RPDO3_LEN                   3
 #define C91_RPDO4_LEN                   4
 
+/* ------------------------------------------------------------------------ */
+/* How the CAN baudrate in use was selected */
+
+#define CAN_BAUDRATE_BY_JUMPERS         0
+#define CAN_BAUDRATE_BY_CONFIG          1
+#define CAN_BAUDRATE_BY_AUTO            2
+#define CAN_BAUDRATE_AUTO_FAILED        3 /* (jumper setting used) */
+
 /* ------------------------------------------------------------------------ */
 /* Function prototypes */
 
 BYTE can_read_reg         ( BYTE regaddr );
 void can_write_reg        ( BYTE regaddr, BYTE byt );
+void can_read_burst       ( BYTE regaddr, BYTE n, BYTE *buf );
+void can_write_burst      ( BYTE regaddr, BYTE n, BYTE *buf );
 void can_init             ( BOOL init_msg_buffer );
 BOOL can_msg_available    ( void );
 BYTE can_read             ( BYTE *pdlc, BYTE **ppmsg_data );
-void can_write            ( BYTE object_no, BYTE len, BYTE *msg_data );
+BOOL can_write            ( BYTE object_no, BYTE len, BYTE *msg_data );
 void can_write_bootup     ( void );
 void can_write_emergency  ( BYTE err_low,
 			    BYTE err_high,
@@ -97,6 +119,7 @@ void can_write_emergency  ( BYTE err_low,
 			    BYTE mfct_field_3,
 			    BYTE canopen_err_bit );
 BOOL can_transmitting     ( BYTE object_no );
+BOOL can_txq_full         ( BYTE object_no );
 void can_check_for_errors ( void );
 void can_rtr_enable       ( BOOL enable );
 BOOL can_set_rtr_disabled ( BOOL disable );
@@ -106,7 +129,103 @@ BOOL can_set_opstate_init ( BOOL enable );
 BOOL can_get_opstate_init ( void );
 BOOL can_set_busoff_maxcnt( BYTE cntr );
 BYTE can_get_busoff_maxcnt( void );
+BOOL can_set_busoff_backoff( BYTE doublings );
+BYTE can_get_busoff_backoff( void );
+BOOL can_set_sync_emg_threshold( BYTE cnt );
+BYTE can_get_sync_emg_threshold( void );
+UINT16 can_get_sync_dropped( void );
+void can_sync_dropped_reset( void );
+BOOL can_set_baudrate_sel ( BYTE baudrate );
+BYTE can_get_baudrate_sel ( void );
+BYTE can_get_baudrate     ( void );
+UINT16 can_get_bitrate_kbps( void );
+BYTE can_get_baudrate_src ( void );
 BOOL can_store_config     ( void );
 
+#ifndef _ELMB103_
+/* Time of reception of received messages (Timer3 value) */
+UINT16 can_read_timestamp ( void );
+UINT16 can_sync_timestamp ( void );
+#endif /* _ELMB103_ */
+
+#ifdef _SPI_STATS_
+/* ------------------------------------------------------------------------ */
+/* Accounting of SPI accesses to the CAN-controller (optional) */
+
+/* Call sites to which the register accesses are attributed */
+#define SPI_SITE_OTHER                  0
+#define SPI_SITE_WRITE                  1 /* can_write()            */
+#define SPI_SITE_INTERRUPT              2 /* canint_handler()       */
+#define SPI_SITE_ERRORS                 3 /* can_check_for_errors() */
+#define SPI_SITE_RTR                    4 /* can_rtr_enable()       */
+#define SPI_SITE_REFRESH                5 /* descriptor refresh     */
+#define SPI_SITES                       6
+
+/* Counter types (= low byte of the OD index) */
+#define SPI_CNT_READS                   0
+#define SPI_CNT_WRITES                  1
+#define SPI_CNT_CLOCKS                  2
+#define SPI_CNT_TYPES                   3
+
+BOOL can_spi_stats_get    ( BYTE cnt_type,
+			    BYTE subind,
+			    BYTE *nbytes,
+			    BYTE *par );
+void can_spi_stats_reset  ( void );
+#endif /* _SPI_STATS_ */
+
+#ifdef _CAN_STATS_
+/* ------------------------------------------------------------------------ */
+/* Receive interrupt and message buffer statistics (optional) */
+
+/* Subindices of the statistics object (times in microseconds) */
+#define CAN_STATS_ISR_CNT               1 /* CAN INT interrupts         */
+#define CAN_STATS_ISR_AVG               2 /* Average time in interrupt  */
+#define CAN_STATS_ISR_MAX               3 /* Maximum time in interrupt  */
+#define CAN_STATS_HIGH_WATER            4 /* Max messages in bulk lane  */
+#define CAN_STATS_LATENCY_AVG           5 /* Average time in buffer     */
+#define CAN_STATS_LATENCY_MAX           6 /* Maximum time in buffer     */
+#define CAN_STATS_OVERRUNS              7 /* Buffer overrun events      */
+#define CAN_STATS_FRAMES                8 /* Messages buffered          */
+#define CAN_STATS_PRIO_LATENCY_MAX      9 /* Max time in priority lane  */
+#define CAN_STATS_TX_DROPS             10 /* Messages lost: queue full  */
+#define CAN_STATS_TXQ_HIGH_WATER       11 /* Max messages in a queue    */
+#define CAN_STATS_RPDO_FAST_CNT        12 /* RPDOs handled in interrupt */
+#define CAN_STATS_RPDO_FAST_MAX        13 /* Max time until handled     */
+#define CAN_STATS_SYNC_LATENCY_AVG     14 /* Average time in buffer and */
+#define CAN_STATS_SYNC_LATENCY_MAX     15 /* maximum, per message type  */
+#define CAN_STATS_RPDO_LATENCY_AVG     16
+#define CAN_STATS_RPDO_LATENCY_MAX     17
+#define CAN_STATS_SDO_LATENCY_AVG      18
+#define CAN_STATS_SDO_LATENCY_MAX      19
+#define CAN_STATS_ENTRIES              19
+
+BOOL can_stats_get        ( BYTE subind, BYTE *nbytes, BYTE *par );
+void can_stats_reset      ( void );
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+/* ------------------------------------------------------------------------ */
+/* Frame counters and this node's traffic share (optional) */
+
+/* Traffic record layout (UINT16s are stored LSB first):
+   byte  0..31: frames received per CAN-controller buffer 0..15 (UINT16)
+   byte 32..63: frames transmitted per CAN-controller buffer 0..15 (UINT16)
+   byte 64..71: error interrupts: warning level, error passive,
+                bus-off, transmit check (UINT16)
+   byte 72..73: this node's traffic share in 0.1 % of the bus capacity
+                over the window: frames received (only those accepted by
+                its buffers) and transmitted; not the bus load (UINT16)
+   byte 74..75: bit rate in kbit/s (UINT16)
+   byte 76    : window length in seconds */
+#define CAN_TRAFFIC_SIZE                77
+
+/* Seconds counter, incremented by the Timer1 interrupt routine */
+extern BYTE CanTrafficSecs;
+
+BYTE can_traffic_read_seg ( BYTE data[7], BYTE *nbytes, BOOL first_segment );
+void can_traffic_reset    ( void );
+#endif /* _CAN_TRAFFIC_ */
+
 #endif /* CAN_H */
 /* ------------------------------------------------------------------------ */
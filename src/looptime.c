@@ -0,0 +1,206 @@
+/* ------------------------------------------------------------------------
+File   : looptime.c
+
+Descr  : Main-loop iteration-time profiler, using the free-running Timer3:
+         keeps minimum, average and maximum iteration time, a histogram
+	 of iteration times with logarithmic bins and the CAN message
+	 (object number) handled in the slowest iteration.
+
+History: 16OCT.26; agent; Definition.
+--------------------------------------------------------------------------- */
+
+#include "general.h"
+#include "can.h"
+#include "looptime.h"
+#include "objects.h"
+#include "timer1XX.h"
+
+#ifdef _LOOP_PROFILE_
+
+/* Timer3 value at the start of the current iteration */
+static UINT16 LoopStart;
+
+/* Object number of the CAN message handled in the current iteration */
+static BYTE   LoopObject;
+
+/* Statistics (times in Timer3 ticks) */
+static UINT16 LoopMin;
+static UINT16 LoopMax;
+static BYTE   LoopMaxObject;
+static UINT32 LoopSum;
+static UINT32 LoopCnt;
+static UINT32 LoopHisto[LOOPTIME_BINS];
+
+/* ------------------------------------------------------------------------ */
+/* Local prototypes */
+
+static void looptime_put_us( UINT16 ticks, BYTE *nbytes, BYTE *par );
+
+/* ------------------------------------------------------------------------ */
+
+void looptime_init( void )
+{
+  BYTE i;
+
+  LoopMin       = 0xFFFF;
+  LoopMax       = 0;
+  LoopMaxObject = NO_OBJECT;
+  LoopSum       = 0L;
+  LoopCnt       = 0L;
+  for( i=0; i<LOOPTIME_BINS; ++i ) LoopHisto[i] = 0L;
+
+  /* Start timing the (next) iteration */
+  LoopObject = NO_OBJECT;
+  LoopStart  = timer3_read();
+  ETIFR      = BIT( T3_OVERFLOW );
+}
+
+/* ------------------------------------------------------------------------ */
+
+void looptime_next( void )
+{
+  /* To be called once at the start of each main-loop iteration:
+     the previous iteration is closed and accounted for */
+  UINT16 now, ticks, mask;
+  BYTE   bin;
+
+  now   = timer3_read();
+  ticks = now - LoopStart;
+
+  /* The timer wrapped around and went past the start value again:
+     more than 65535 ticks (1.049 s) elapsed, saturate */
+  if( (ETIFR & BIT(T3_OVERFLOW)) && now >= LoopStart ) ticks = 0xFFFF;
+
+  /* Start timing the next iteration: clear the timer overflow flag,
+     by writing a 1 ! */
+  LoopStart = now;
+  ETIFR     = BIT( T3_OVERFLOW );
+
+  if( ticks < LoopMin ) LoopMin = ticks;
+  if( ticks > LoopMax )
+    {
+      LoopMax       = ticks;
+      LoopMaxObject = LoopObject;
+    }
+
+  /* Stop accumulating when the counters would overflow */
+  if( LoopCnt != 0xFFFFFFFF && LoopSum <= 0xFFFFFFFF - (UINT32) ticks )
+    {
+      LoopSum += (UINT32) ticks;
+      ++LoopCnt;
+    }
+
+  /* Histogram bin: position of the highest bit set */
+  bin  = LOOPTIME_BINS-1;
+  mask = 0x8000;
+  while( bin > 0 && (ticks & mask) == 0 )
+    {
+      --bin;
+      mask >>= 1;
+    }
+  if( LoopHisto[bin] != 0xFFFFFFFF ) ++LoopHisto[bin];
+
+  LoopObject = NO_OBJECT;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void looptime_object( BYTE object_no )
+{
+  /* Remember which CAN message is handled in this iteration */
+  LoopObject = object_no;
+}
+
+/* ------------------------------------------------------------------------ */
+
+BOOL looptime_get_stats( BYTE subind, BYTE *nbytes, BYTE *par )
+{
+  switch( subind )
+    {
+    case OD_NO_OF_ENTRIES:
+      par[0]  = LOOPTIME_ENTRIES;
+      *nbytes = 1;  /* Significant bytes < 4 */
+      break;
+
+    case LOOPTIME_MIN:
+      if( LoopCnt == 0L )
+	looptime_put_us( 0, nbytes, par );
+      else
+	looptime_put_us( LoopMin, nbytes, par );
+      break;
+
+    case LOOPTIME_AVG:
+      if( LoopCnt == 0L )
+	looptime_put_us( 0, nbytes, par );
+      else
+	looptime_put_us( (UINT16) (LoopSum / LoopCnt), nbytes, par );
+      break;
+
+    case LOOPTIME_MAX:
+      looptime_put_us( LoopMax, nbytes, par );
+      break;
+
+    case LOOPTIME_MAX_OBJECT:
+      par[0]  = LoopMaxObject;
+      *nbytes = 1;  /* Significant bytes < 4 */
+      break;
+
+    case LOOPTIME_ITERATIONS:
+      par[0] = (BYTE) (LoopCnt & 0x000000FF);
+      par[1] = (BYTE) ((LoopCnt & 0x0000FF00) >> 8);
+      par[2] = (BYTE) ((LoopCnt & 0x00FF0000) >> 16);
+      par[3] = (BYTE) ((LoopCnt & 0xFF000000) >> 24);
+      *nbytes = 4;
+      break;
+
+    default:
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------ */
+
+BOOL looptime_get_histogram( BYTE subind, BYTE *nbytes, BYTE *par )
+{
+  UINT32 cnt;
+
+  if( subind == OD_NO_OF_ENTRIES )
+    {
+      par[0]  = LOOPTIME_BINS;
+      *nbytes = 1;  /* Significant bytes < 4 */
+      return TRUE;
+    }
+
+  if( subind > LOOPTIME_BINS ) return FALSE;
+
+  /* Subindex 1 corresponds to bin 0, etc. */
+  cnt = LoopHisto[subind-1];
+  par[0] = (BYTE) (cnt & 0x000000FF);
+  par[1] = (BYTE) ((cnt & 0x0000FF00) >> 8);
+  par[2] = (BYTE) ((cnt & 0x00FF0000) >> 16);
+  par[3] = (BYTE) ((cnt & 0xFF000000) >> 24);
+  *nbytes = 4;
+
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void looptime_put_us( UINT16 ticks, BYTE *nbytes, BYTE *par )
+{
+  /* Convert Timer3 ticks to microseconds */
+  UINT32 us;
+
+  us = (UINT32) ticks * T3_MUS_PER_TICK;
+
+  par[0] = (BYTE) (us & 0x000000FF);
+  par[1] = (BYTE) ((us & 0x0000FF00) >> 8);
+  par[2] = (BYTE) ((us & 0x00FF0000) >> 16);
+  par[3] = (BYTE) ((us & 0xFF000000) >> 24);
+  *nbytes = 4;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#endif /* _LOOP_PROFILE_ */
@@ -0,0 +1,44 @@
+/* ------------------------------------------------------------------------
+File   : looptime.h
+
+Descr  : Definitions and declarations for the main-loop iteration-time
+         profiler (compile option _LOOP_PROFILE_).
+
+History: 16OCT.26; agent; Definition.
+--------------------------------------------------------------------------- */
+
+#ifndef LOOPTIME_H
+#define LOOPTIME_H
+
+#ifdef _LOOP_PROFILE_
+
+#ifdef _ELMB103_
+#error "_LOOP_PROFILE_ requires Timer3, not available on the ATmega103"
+#endif /* _ELMB103_ */
+
+/* Number of bins in the (log2) iteration-time histogram:
+   bin 0 counts iterations of 0 or 1 Timer3 ticks,
+   bin i (i>0) counts iterations of 2^i up to 2^(i+1)-1 ticks */
+#define LOOPTIME_BINS          16
+
+/* Subindices of the loop-time statistics object */
+#define LOOPTIME_MIN           1
+#define LOOPTIME_AVG           2
+#define LOOPTIME_MAX           3
+#define LOOPTIME_MAX_OBJECT    4
+#define LOOPTIME_ITERATIONS    5
+#define LOOPTIME_ENTRIES       5
+
+/* ------------------------------------------------------------------------ */
+/* Function prototypes */
+
+void looptime_init         ( void );
+void looptime_next         ( void );
+void looptime_object       ( BYTE object_no );
+BOOL looptime_get_stats    ( BYTE subind, BYTE *nbytes, BYTE *par );
+BOOL looptime_get_histogram( BYTE subind, BYTE *nbytes, BYTE *par );
+
+#endif /* _LOOP_PROFILE_ */
+
+#endif /* LOOPTIME_H */
+/* ------------------------------------------------------------------------ */
@@ -5,6 +5,14 @@ Descr  : Definitions of the CANopen Object Dictionary objects
          for this application.
 
 History: --JUL.00; Henk B&B; First version.
+         16OCT.26; agent; Added SPI access statistics objects.
+	 16OCT.26; agent; Added main-loop iteration-time objects.
+	 16OCT.26; agent; Added CAN receive statistics object.
+	 16OCT.26; agent; Added CAN traffic record object.
+	 16OCT.26; agent; Added protected-byte selftest subindex.
+	 16OCT.26; agent; Added dropped-SYNC counter object and
+			  Emergency code.
+	 16OCT.26; agent; Added CAN baudrate-in-use object.
 --------------------------------------------------------------------------- */
 
 #ifndef OBJECTS_H
@@ -86,6 +94,27 @@ History: --JUL.00; Henk B&B; First version.
 /* CAN-controller configuration */
 #define OD_CAN_CONFIG_HI        0x32		/* Objects 0x32.. */
 #define OD_CAN_CONFIG_LO        0x00		/* Object  0x3200 */
+#define OD_CAN_BAUDRATE_LO      0x01		/* Object  0x3201 */
+#define OD_CAN_SYNC_DROPPED_LO  0x02		/* Object  0x3202 */
+
+/* CAN-controller SPI access statistics (optional) */
+#define OD_SPI_STATS_HI         0x33		/* Objects 0x33.. */
+#define OD_SPI_READS_LO         0x00		/* Object  0x3300 */
+#define OD_SPI_WRITES_LO        0x01		/* Object  0x3301 */
+#define OD_SPI_CLOCKS_LO        0x02		/* Object  0x3302 */
+
+/* Main-loop iteration-time profile (optional) */
+#define OD_LOOPTIME_HI          0x34		/* Objects 0x34.. */
+#define OD_LOOPTIME_STATS_LO    0x00		/* Object  0x3400 */
+#define OD_LOOPTIME_HISTO_LO    0x01		/* Object  0x3401 */
+
+/* CAN receive interrupt and message buffer statistics (optional) */
+#define OD_CAN_STATS_HI         0x35		/* Objects 0x35.. */
+#define OD_CAN_STATS_LO         0x00		/* Object  0x3500 */
+
+/* CAN frame counters and traffic share (optional) */
+#define OD_CAN_TRAFFIC_HI       0x36		/* Objects 0x36.. */
+#define OD_CAN_TRAFFIC_LO       0x00		/* Object  0x3600 */
 
 /* Other */
 #define OD_COMPILE_OPTIONS_HI   0x5C		/* Objects 0x5C.. */
@@ -94,6 +123,8 @@ History: --JUL.00; Henk B&B; First version.
 #define OD_TEST_HI              0x5D		/* Objects 0x5D.. */
 #define OD_TEST_LO              0xFF		/* Object  0x5DFF */
 #define OD_IO_TEST              1
+#define OD_PROT_BYTE_TEST       2
+#define OD_PROT_BYTE_TEST_3DIFF 3
 
 #define OD_SWITCH_TO_LOADER_HI  0x5E		/* Objects 0x5E.. */
 #define OD_SWITCH_TO_LOADER_LO  0x00		/* Object  0x5E00 */
@@ -134,6 +165,8 @@ History: --JUL.00; Henk B&B; First version.
 #define EMG_EEPROM_WRITE_PARS   0x41
 #define EMG_EEPROM_READ_PARS    0x42
 
+#define EMG_SYNC_OVERRUN        0x60
+
 #define EMG_IRREGULAR_RESET     0xF0
 #define EMG_NO_BOOTLOADER       0xF1
 
@@ -6,6 +6,7 @@ Descr  : Functions for CANopen PDO handling, which call node-specific
 
 History: ..DEC.03; Henk B&B; Definition for ELMB framework, based on
                              existing applications.
+	 16OCT.26; agent; Added RPDO 'fast' handlers (_RPDO_FAST_).
 --------------------------------------------------------------------------- */
 
 #include "general.h"
@@ -36,6 +37,11 @@ extern const BYTE   PDOMAP_CNT[TPDO_CNT+RPDO_CNT];
 /* Per PDO the mapped objects */
 extern const UINT32 PDOMAP[TPDO_CNT+RPDO_CNT][APP_MAX_MAPPED_CNT];
 
+#ifdef _RPDO_FAST_
+/* Per RPDO the function to call from the CAN INT interrupt (or 0) */
+extern const RPDO_FAST_FUNC APP_RPDO_FAST[RPDO_CNT];
+#endif /* _RPDO_FAST_ */
+
 /* ------------------------------------------------------------------------ */
 /* Globals */
 
@@ -308,6 +314,26 @@ void rpdo( BYTE pdo_no, BYTE dlc, BYTE *can_data )
     }
 }
 
+#ifdef _RPDO_FAST_
+/* ------------------------------------------------------------------------ */
+
+BOOL rpdo_fast_enabled( BYTE pdo_no )
+{
+  /* Is this RPDO to be handled in the CAN INT interrupt ? */
+  if( pdo_no >= RPDO_CNT ) return FALSE;
+  return( APP_RPDO_FAST[pdo_no] != 0 );
+}
+
+/* ------------------------------------------------------------------------ */
+
+void rpdo_fast( BYTE pdo_no, BYTE dlc, BYTE *can_data )
+{
+  /* Called from the CAN INT interrupt
+     (after checking with rpdo_fast_enabled()) */
+  (*APP_RPDO_FAST[pdo_no])( dlc, can_data );
+}
+#endif /* _RPDO_FAST_ */
+
 /* ------------------------------------------------------------------------ */
 
 BOOL pdo_rtr_required( void )
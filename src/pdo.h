@@ -5,6 +5,7 @@ Descr  : Definitions and declarations for CANopen PDO functions.
 
 History: ..DEC.03; Henk B&B; Definition for ELMB framework, based on
                              existing applications.
+	 16OCT.26; agent; Added RPDO 'fast' handlers (_RPDO_FAST_).
 --------------------------------------------------------------------------- */
 
 #ifndef PDO_H
@@ -20,6 +21,11 @@ History: ..DEC.03; Henk B&B; Definition for ELMB framework, based on
 #define TPDO_APP_IN       (1-1)
 #define RPDO_APP_OUT      (1-1)
 
+#ifdef _RPDO_FAST_
+/* Function handling an RPDO directly in the CAN INT interrupt */
+typedef void (*RPDO_FAST_FUNC)( BYTE dlc, BYTE *can_data );
+#endif /* _RPDO_FAST_ */
+
 /* ------------------------------------------------------------------------ */
 /* Globals */
 
@@ -38,6 +44,10 @@ void pdo_on_nmt        ( BYTE nmt_request );
 void tpdo_on_sync      ( void );
 void tpdo_on_rtr       ( BYTE pdo_no );
 void rpdo              ( BYTE pdo_no, BYTE dlc, BYTE *can_data );
+#ifdef _RPDO_FAST_
+BOOL rpdo_fast_enabled ( BYTE pdo_no );
+void rpdo_fast         ( BYTE pdo_no, BYTE dlc, BYTE *can_data );
+#endif /* _RPDO_FAST_ */
 BOOL pdo_rtr_required  ( void );
 
 BOOL tpdo_get_comm_par ( BYTE pdo_no,
@@ -0,0 +1,199 @@
+/* ------------------------------------------------------------------------
+File   : protbyte.c
+
+Descr  : Functions for 'protected' bytes: 3 copies of a byte and
+         a bit-parallel majority vote (replaces the compare-and-copy
+	 plus bit-by-bit voting loop used before in can.c);
+	 optionally (compile option _INCLUDE_TESTS_) a selftest with
+	 bitflip injection and a measurement of the voting time.
+
+History: 16OCT.26; agent; Definition.
+--------------------------------------------------------------------------- */
+
+#include "general.h"
+#include "protbyte.h"
+#include "timer1XX.h"
+
+/* ------------------------------------------------------------------------ */
+
+BYTE prot_get( PROT_BYTE *p )
+{
+  /* Majority vote, and correct any bitflips */
+  BYTE val;
+
+  val = MAJORITY( p->b1, p->b2, p->b3 );
+  p->b1 = val;  p->b2 = val;  p->b3 = val;
+
+  return val;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void prot_set( PROT_BYTE *p, BYTE val )
+{
+  p->b1 = val;  p->b2 = val;  p->b3 = val;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef _INCLUDE_TESTS_
+
+/* Number of votes timed per method */
+#define PROT_TEST_VOTES  64
+
+static void prot_test_corrupt( PROT_BYTE *p, BOOL all_differ );
+static BYTE prot_get_bitloop ( PROT_BYTE *p );
+
+/* ------------------------------------------------------------------------ */
+
+void prot_test( BYTE *result, BOOL all_differ )
+{
+  /* Selftest of the protected byte:
+     - result[0]: number of failures with a single bitflip
+       (all values, all bits of all 3 copies)
+     - result[1]: number of failures with 2 bitflips, in different bit
+       positions of 2 different copies (a selection of values)
+     (a failure is a wrong vote result or a copy not being corrected;
+      counts saturate at 255)
+     - result[2]: time for PROT_TEST_VOTES votes by prot_get(),
+     - result[3]: same by the previously used bit-by-bit voting loop,
+       in Timer3 ticks of 16 us (saturate at 255; 0 on the ATmega103);
+       the votes are timed with one copy different or, if 'all_differ'
+       is TRUE, with all 3 copies different (the old voting's worst case:
+       its bit-by-bit loop) */
+  PROT_BYTE pb;
+  BYTE      val, copy, bit, bit2, err;
+  BOOL      done;
+
+  /* Single bitflips */
+  err  = 0;
+  val  = 0;
+  done = FALSE;
+  while( !done )
+    {
+      for( copy=0; copy<3; ++copy )
+	for( bit=0; bit<8; ++bit )
+	  {
+	    prot_set( &pb, val );
+	    if( copy == 0 ) pb.b1 ^= BIT(bit);
+	    if( copy == 1 ) pb.b2 ^= BIT(bit);
+	    if( copy == 2 ) pb.b3 ^= BIT(bit);
+	    if( PROT_PEEK( &pb ) != val || prot_get( &pb ) != val ||
+		pb.b1 != val || pb.b2 != val || pb.b3 != val )
+	      if( err != 0xFF ) ++err;
+	  }
+      ++val;
+      if( val == 0 ) done = TRUE;
+    }
+  result[0] = err;
+
+  /* Double bitflips in 2 different copies (copy and copy+1 modulo 3) */
+  err  = 0;
+  val  = 0;
+  done = FALSE;
+  while( !done )
+    {
+      for( copy=0; copy<3; ++copy )
+	for( bit=0; bit<8; ++bit )
+	  for( bit2=0; bit2<8; ++bit2 )
+	    {
+	      if( bit2 == bit ) continue;
+	      prot_set( &pb, val );
+	      if( copy == 0 ) { pb.b1 ^= BIT(bit); pb.b2 ^= BIT(bit2); }
+	      if( copy == 1 ) { pb.b2 ^= BIT(bit); pb.b3 ^= BIT(bit2); }
+	      if( copy == 2 ) { pb.b3 ^= BIT(bit); pb.b1 ^= BIT(bit2); }
+	      if( prot_get( &pb ) != val ||
+		  pb.b1 != val || pb.b2 != val || pb.b3 != val )
+		if( err != 0xFF ) ++err;
+	    }
+      val += 0x11;
+      if( val == 0 ) done = TRUE;
+    }
+  result[1] = err;
+
+#ifndef _ELMB103_
+  {
+    UINT16 t_start, ticks;
+    BYTE   i;
+
+    /* Time the votes, with one or all copies being different each time
+       (interrupts disabled while timing) */
+    CLI();
+    t_start = timer3_read();
+    for( i=0; i<PROT_TEST_VOTES; ++i )
+      {
+	prot_set( &pb, i );
+	prot_test_corrupt( &pb, all_differ );
+	prot_get( &pb );
+      }
+    ticks = timer3_read() - t_start;
+    if( ticks > 0xFF ) ticks = 0xFF;
+    result[2] = (BYTE) ticks;
+
+    t_start = timer3_read();
+    for( i=0; i<PROT_TEST_VOTES; ++i )
+      {
+	prot_set( &pb, i );
+	prot_test_corrupt( &pb, all_differ );
+	prot_get_bitloop( &pb );
+      }
+    ticks = timer3_read() - t_start;
+    SEI();
+    if( ticks > 0xFF ) ticks = 0xFF;
+    result[3] = (BYTE) ticks;
+  }
+#else
+  result[2] = 0;
+  result[3] = 0;
+#endif /* _ELMB103_ */
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void prot_test_corrupt( PROT_BYTE *p, BOOL all_differ )
+{
+  /* Make one copy different or make all 3 copies different from each other
+     (but still with a majority in every bit position) */
+  if( all_differ )
+    {
+      p->b1 ^= 0x01;
+      p->b2 ^= 0x02;
+    }
+  else
+    {
+      p->b2 ^= 0x01;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+static BYTE prot_get_bitloop( PROT_BYTE *p )
+{
+  /* The majority voting as done before (for comparison only) */
+  if( p->b1 == p->b2 ) p->b3 = p->b1;
+  else if( p->b1 == p->b3 ) p->b2 = p->b1;
+  else if( p->b2 == p->b3 ) p->b1 = p->b3;
+  else
+    {
+      /* All 3 are different: do a majority vote on a bit-by-bit basis... */
+      BYTE byt, bitmask, bits, i;
+      byt     = 0x00; /* Start value */
+      bitmask = 0x80; /* Start with MSB */
+      for( i=0; i<8; ++i )
+	{
+	  bits = 0;
+	  if( p->b1 & bitmask ) ++bits;
+	  if( p->b2 & bitmask ) ++bits;
+	  if( p->b3 & bitmask ) ++bits;
+	  byt <<= 1; /* Shift value one bit up*/
+	  if( bits > 1 ) ++byt; /* 2 or 3 of the bits (majority) are set */
+	  bitmask >>= 1; /* Next bit to check */
+	}
+      p->b1 = byt;  p->b2 = byt;  p->b3 = byt;
+    }
+  return p->b1;
+}
+
+#endif /* _INCLUDE_TESTS_ */
+
+/* ------------------------------------------------------------------------ */
@@ -0,0 +1,48 @@
+/* ------------------------------------------------------------------------
+File   : protbyte.h
+
+Descr  : Definitions and declarations for 'protected' bytes: bytes stored
+         as 3 copies, read by a (bit-parallel) majority vote, to tolerate
+	 Single Event Upsets (bitflips).
+
+History: 16OCT.26; agent; Definition.
+--------------------------------------------------------------------------- */
+
+#ifndef PROTBYTE_H
+#define PROTBYTE_H
+
+/* ------------------------------------------------------------------------ */
+/* Type definitions */
+
+typedef struct prot_byte
+{
+  BYTE b1, b2, b3;
+} PROT_BYTE;
+
+/* ------------------------------------------------------------------------ */
+/* Macros */
+
+/* Majority vote on each bit position: a bit is set if it is set
+   in at least 2 of the 3 copies; this tolerates any number of bitflips
+   as long as they are not in the same bit position of 2 copies */
+#define MAJORITY(a,b,c)  (((a) & (b)) | ((a) & (c)) | ((b) & (c)))
+
+/* Value of a protected byte, without correcting it
+   (for use on a protected byte owned by an interrupt routine,
+    or vice versa: no writes, so no need to disable the interrupt;
+    while the 3 copies are being written the result is either
+    the old or the new value) */
+#define PROT_PEEK(p)     MAJORITY( (p)->b1, (p)->b2, (p)->b3 )
+
+/* ------------------------------------------------------------------------ */
+/* Function prototypes */
+
+BYTE prot_get ( PROT_BYTE *p );
+void prot_set ( PROT_BYTE *p, BYTE val );
+
+#ifdef _INCLUDE_TESTS_
+void prot_test( BYTE *result, BOOL all_differ );
+#endif /* _INCLUDE_TESTS_ */
+
+/* ------------------------------------------------------------------------ */
+#endif /* PROTBYTE_H */
@@ -5,6 +5,20 @@ Descr  : The CANopen SDO server, which serves read/write requests to the
 	 Object Dictionary.
 
 History: 25JAN.00; Henk B&B; Start of development of a version for the ELMB.
+         16OCT.26; agent; Added SPI access statistics objects.
+	 16OCT.26; agent; Added main-loop iteration-time objects.
+	 16OCT.26; agent; Added CAN receive statistics object.
+	 16OCT.26; agent; Added CAN traffic record object
+			  (first Segmented SDO upload outside app.c).
+	 16OCT.26; agent; Report _HW_SPI_ in the compile options.
+	 16OCT.26; agent; Added protected-byte selftest (_INCLUDE_TESTS_).
+	 16OCT.26; agent; Added CAN Bus-off back-off configuration.
+	 16OCT.26; agent; Report _RPDO_FAST_ in the compile options.
+	 16OCT.26; agent; Added SYNC Emergency threshold (0x3200 sub 5)
+			  and dropped-SYNC counter (0x3202).
+	 16OCT.26; agent; Added CAN baudrate selection (0x3200 sub 6).
+	 16OCT.26; agent; Added CAN baudrate in use (0x3201);
+			  report _CAN_AUTOBAUD_ in the compile options.
 --------------------------------------------------------------------------- */
 
 #include "general.h"
@@ -13,6 +27,7 @@ History: 25JAN.00; Henk B&B; Start of development of a version for the ELMB.
 #include "can.h"
 #include "crc.h"
 #include "guarding.h"
+#include "looptime.h"
 #include "objects.h"
 #include "pdo.h"
 #include "serialno.h"
@@ -26,6 +41,7 @@ History: 25JAN.00; Henk B&B; Start of development of a version for the ELMB.
 
 #ifdef _INCLUDE_TESTS_
 #include "iotest.h"
+#include "protbyte.h"
 #endif
 
 /* Parameters for Segmented SDO transfer */
@@ -444,7 +460,7 @@ static BYTE sdo_read( BYTE *msg_data )
 	  switch( od_subind )
 	    {
 	    case OD_NO_OF_ENTRIES:
-	      msg_data[4] = 3;
+	      msg_data[4] = 6;
 	      nbytes = 1;  /* Significant bytes < 4 */
 	      break;
 	    case 1:
@@ -459,12 +475,69 @@ static BYTE sdo_read( BYTE *msg_data )
 	      msg_data[4] = can_get_busoff_maxcnt();
 	      nbytes = 1;  /* Significant bytes < 4 */
 	      break;
+	    case 4:
+	      msg_data[4] = can_get_busoff_backoff();
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    case 5:
+	      msg_data[4] = can_get_sync_emg_threshold();
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    case 6:
+	      msg_data[4] = can_get_baudrate_sel();
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
 	    default:
 	      /* The sub-index does not exist */
 	      sdo_error = SDO_ECODE_ATTRIBUTE;
 	      break;
 	    }
 	}
+      else if( od_index_lo == OD_CAN_BAUDRATE_LO )
+	{
+	  switch( od_subind )
+	    {
+	    case OD_NO_OF_ENTRIES:
+	      msg_data[4] = 3;
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    case 1:
+	      msg_data[4] = can_get_baudrate();
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    case 2:
+	      {
+		UINT16 kbps = can_get_bitrate_kbps();
+		msg_data[4] = (BYTE) (kbps & 0x00FF);
+		msg_data[5] = (BYTE) ((kbps & 0xFF00) >> 8);
+		nbytes = 2;  /* Significant bytes < 4 */
+	      }
+	      break;
+	    case 3:
+	      msg_data[4] = can_get_baudrate_src();
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    default:
+	      /* The sub-index does not exist */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	      break;
+	    }
+	}
+      else if( od_index_lo == OD_CAN_SYNC_DROPPED_LO )
+	{
+	  if( od_subind == 0 )
+	    {
+	      UINT16 cnt = can_get_sync_dropped();
+	      msg_data[4] = (BYTE) (cnt & 0x00FF);
+	      msg_data[5] = (BYTE) ((cnt & 0xFF00) >> 8);
+	      nbytes = 2;  /* Significant bytes < 4 */
+	    }
+	  else
+	    {
+	      /* The sub-index does not exist */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
       else
 	{
 	  /* The index can not be accessed, does not exist */
@@ -596,6 +669,101 @@ static BYTE sdo_read( BYTE *msg_data )
 	}
       break;
 
+#ifdef _SPI_STATS_
+    case OD_SPI_STATS_HI:
+      /* Object index low byte selects reads, writes or SPI clocks,
+	 subindex selects the call site (see can.h) */
+      if( can_spi_stats_get( od_index_lo, od_subind,
+			     &nbytes, &msg_data[4] ) == FALSE )
+	{
+	  if( od_index_lo < SPI_CNT_TYPES )
+	    /* The sub-index does not exist */
+	    sdo_error = SDO_ECODE_ATTRIBUTE;
+	  else
+	    /* The index can not be accessed, does not exist */
+	    sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _SPI_STATS_ */
+
+#ifdef _LOOP_PROFILE_
+    case OD_LOOPTIME_HI:
+      {
+	BOOL result;
+
+	switch( od_index_lo )
+	  {
+	  case OD_LOOPTIME_STATS_LO:
+	    result = looptime_get_stats( od_subind, &nbytes, &msg_data[4] );
+	    break;
+	  case OD_LOOPTIME_HISTO_LO:
+	    result = looptime_get_histogram( od_subind,
+					     &nbytes, &msg_data[4] );
+	    break;
+	  default:
+	    /* The index can not be accessed, does not exist */
+	    sdo_error = SDO_ECODE_NONEXISTENT;
+	    result    = TRUE;
+	    break;
+	  }
+	if( result == FALSE )
+	  {
+	    /* The sub-index does not exist */
+	    sdo_error = SDO_ECODE_ATTRIBUTE;
+	  }
+      }
+      break;
+#endif /* _LOOP_PROFILE_ */
+
+#ifdef _CAN_STATS_
+    case OD_CAN_STATS_HI:
+      if( od_index_lo == OD_CAN_STATS_LO )
+	{
+	  if( can_stats_get( od_subind, &nbytes, &msg_data[4] ) == FALSE )
+	    {
+	      /* The sub-index does not exist */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+    case OD_CAN_TRAFFIC_HI:
+      if( od_index_lo == OD_CAN_TRAFFIC_LO )
+	{
+	  switch( od_subind )
+	    {
+	    case OD_NO_OF_ENTRIES:
+	      msg_data[4] = 1;
+	      nbytes = 1;  /* Significant bytes < 4 */
+	      break;
+	    case 1:
+	      /* To be read by Segmented SDO: return size in bytes */
+	      msg_data[4] = CAN_TRAFFIC_SIZE;
+	      segmented   = TRUE;
+	      sdo_error   = sdo_segmented_init( msg_data );
+	      UploadSeg   = TRUE; /* Uploading... */
+	      break;
+	    default:
+	      /* The sub-index does not exist */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	      break;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _CAN_TRAFFIC_ */
+
     case OD_COMPILE_OPTIONS_HI:
       if( od_index_lo == OD_COMPILE_OPTIONS_LO )
 	{
@@ -618,6 +786,27 @@ static BYTE sdo_read( BYTE *msg_data )
 #endif
 #ifdef _2313_SLAVE_PRESENT_
 	      msg_data[5] |= 0x20;
+#endif
+#ifdef _SPI_STATS_
+	      msg_data[6] |= 0x01;
+#endif
+#ifdef _LOOP_PROFILE_
+	      msg_data[6] |= 0x02;
+#endif
+#ifdef _CAN_STATS_
+	      msg_data[6] |= 0x04;
+#endif
+#ifdef _CAN_TRAFFIC_
+	      msg_data[6] |= 0x08;
+#endif
+#ifdef _HW_SPI_
+	      msg_data[6] |= 0x10;
+#endif
+#ifdef _RPDO_FAST_
+	      msg_data[6] |= 0x20;
+#endif
+#ifdef _CAN_AUTOBAUD_
+	      msg_data[6] |= 0x40;
 #endif
 	    }
 	  else
@@ -643,7 +832,7 @@ static BYTE sdo_read( BYTE *msg_data )
 	    {
 	    case OD_NO_OF_ENTRIES:
 	      /* The number of tests available */
-	      msg_data[4] = 1;
+	      msg_data[4] = 3;
 	      nbytes = 1;  /* Significant bytes < 4 */
 	      break;
 
@@ -654,6 +843,17 @@ static BYTE sdo_read( BYTE *msg_data )
 	      iotest( &msg_data[4] );
 	      break;
 
+	    case OD_PROT_BYTE_TEST:
+	      /* Test the (SEU-tolerant) protected byte by injecting
+		 bitflips; also times its majority voting */
+	      prot_test( &msg_data[4], FALSE );
+	      break;
+
+	    case OD_PROT_BYTE_TEST_3DIFF:
+	      /* Same, but timing the voting with all 3 copies different */
+	      prot_test( &msg_data[4], TRUE );
+	      break;
+
 	    default:
 	      /* The sub-index does not exist */
 	      sdo_error = SDO_ECODE_ATTRIBUTE;
@@ -1018,12 +1218,60 @@ static BYTE sdo_expedited_write( BYTE *msg_data )
 		/* Wrong number of bytes provided */
 		sdo_error = SDO_ECODE_TYPE_CONFLICT;
 	      break;
+	    case 4:
+	      if( nbytes <= 1 )
+		{
+		  if( can_set_busoff_backoff( msg_data[4] ) == FALSE )
+		    sdo_error = SDO_ECODE_ATTRIBUTE;
+		}
+	      else
+		/* Wrong number of bytes provided */
+		sdo_error = SDO_ECODE_TYPE_CONFLICT;
+	      break;
+	    case 5:
+	      if( nbytes <= 1 )
+		{
+		  if( can_set_sync_emg_threshold( msg_data[4] ) == FALSE )
+		    sdo_error = SDO_ECODE_ATTRIBUTE;
+		}
+	      else
+		/* Wrong number of bytes provided */
+		sdo_error = SDO_ECODE_TYPE_CONFLICT;
+	      break;
+	    case 6:
+	      if( nbytes <= 1 )
+		{
+		  if( can_set_baudrate_sel( msg_data[4] ) == FALSE )
+		    sdo_error = SDO_ECODE_ATTRIBUTE;
+		}
+	      else
+		/* Wrong number of bytes provided */
+		sdo_error = SDO_ECODE_TYPE_CONFLICT;
+	      break;
 	    default:
 	      /* The sub-index does not exist */
 	      sdo_error = SDO_ECODE_ATTRIBUTE;
 	      break;
 	    }
 	}
+      else if( od_index_lo == OD_CAN_BAUDRATE_LO )
+	{
+	  /* Read-only (select the baudrate with 0x3200 sub 6) */
+	  sdo_error = SDO_ECODE_ATTRIBUTE;
+	}
+      else if( od_index_lo == OD_CAN_SYNC_DROPPED_LO )
+	{
+	  if( od_subind == 0 )
+	    {
+	      /* Writing (any value) resets the counter */
+	      can_sync_dropped_reset();
+	    }
+	  else
+	    {
+	      /* The sub-index does not exist */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
       else
 	{
 	  /* The index can not be accessed, does not exist */
@@ -1032,6 +1280,99 @@ static BYTE sdo_expedited_write( BYTE *msg_data )
 	}
       break;
 
+#ifdef _SPI_STATS_
+    case OD_SPI_STATS_HI:
+      if( od_index_lo < SPI_CNT_TYPES )
+	{
+	  if( od_subind == OD_NO_OF_ENTRIES )
+	    {
+	      /* Writing (any value) to subindex 0 resets all counters */
+	      can_spi_stats_reset();
+	    }
+	  else
+	    {
+	      /* The counters themselves are read-only */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _SPI_STATS_ */
+
+#ifdef _LOOP_PROFILE_
+    case OD_LOOPTIME_HI:
+      if( od_index_lo == OD_LOOPTIME_STATS_LO ||
+	  od_index_lo == OD_LOOPTIME_HISTO_LO )
+	{
+	  if( od_subind == OD_NO_OF_ENTRIES )
+	    {
+	      /* Writing (any value) to subindex 0 restarts the profile */
+	      looptime_init();
+	    }
+	  else
+	    {
+	      /* The statistics themselves are read-only */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _LOOP_PROFILE_ */
+
+#ifdef _CAN_STATS_
+    case OD_CAN_STATS_HI:
+      if( od_index_lo == OD_CAN_STATS_LO )
+	{
+	  if( od_subind == OD_NO_OF_ENTRIES )
+	    {
+	      /* Writing (any value) to subindex 0 resets the statistics */
+	      can_stats_reset();
+	    }
+	  else
+	    {
+	      /* The statistics themselves are read-only */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _CAN_STATS_ */
+
+#ifdef _CAN_TRAFFIC_
+    case OD_CAN_TRAFFIC_HI:
+      if( od_index_lo == OD_CAN_TRAFFIC_LO )
+	{
+	  if( od_subind == OD_NO_OF_ENTRIES )
+	    {
+	      /* Writing (any value) to subindex 0 resets the counters */
+	      can_traffic_reset();
+	    }
+	  else
+	    {
+	      /* The record itself is read-only */
+	      sdo_error = SDO_ECODE_ATTRIBUTE;
+	    }
+	}
+      else
+	{
+	  /* The index can not be accessed, does not exist */
+	  sdo_error = SDO_ECODE_NONEXISTENT;
+	}
+      break;
+#endif /* _CAN_TRAFFIC_ */
+
     case OD_ELMB_SERIAL_NO_HI:
       switch( od_index_lo )
 	{
@@ -1270,8 +1611,13 @@ static BYTE sdo_segmented_read( BYTE *msg_data, BYTE *error_class )
   for( nbytes=1; nbytes<8; ++nbytes ) msg_data[nbytes] = 0;
 
   /* Read the requested object (segmented) */
-  sdo_error = app_sdo_read_seg( OdIndexHiSeg, OdIndexLoSeg, OdSubindSeg,
-				&msg_data[1], &nbytes, FirstSeg );
+#ifdef _CAN_TRAFFIC_
+  if( OdIndexHiSeg == OD_CAN_TRAFFIC_HI )
+    sdo_error = can_traffic_read_seg( &msg_data[1], &nbytes, FirstSeg );
+  else
+#endif /* _CAN_TRAFFIC_ */
+    sdo_error = app_sdo_read_seg( OdIndexHiSeg, OdIndexLoSeg, OdSubindSeg,
+				  &msg_data[1], &nbytes, FirstSeg );
 
   if( sdo_error == SDO_ECODE_OKAY )
     {
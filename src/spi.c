@@ -7,9 +7,75 @@ History: 19JAN.00; Henk B&B; Definition.
          27SEP.00; Henk B&B; Rewrote functions to get more even bit stream.
 	                     (added spi_clk()).
 	 06AUG.01; Henk B&B; Replaced spi_clk() by macro.
+	 16OCT.26; agent; Optionally use the on-chip SPI peripheral
+			  (compile option _HW_SPI_).
 --------------------------------------------------------------------------- */
 
 #include "general.h"
+#include "spi.h"
+
+#ifdef _HW_SPI_
+
+/* ------------------------------------------------------------------------ */
+/* Hardware SPI: PB1 (SCK), PB2 (MOSI) and PB3 (MISO) are the SCLK, SDI
+   and SDO lines of the CAN-controller; NB: PB0 is the SPI's SS pin,
+   which is also used for reading the jumpers: if it is pulled low
+   while the SPI is enabled the SPI drops out of Master mode, so disable
+   the SPI while reading jumpers (see can_init()) */
+
+void spi_init( void )
+{
+  BYTE dummy;
+
+  /* Enable, Master, MSB first, SCK low when idle, sample on rising edge
+     (mode 0), SCK = CK/4 */
+  SPCR = SPI_SPCR_SETTING;
+
+  /* Clear the SPI interrupt flag (by reading SPSR followed by SPDR) */
+  dummy = SPSR;
+  dummy = SPDR;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void spi_disable( void )
+{
+  SPCR = 0x00;
+}
+
+/* ------------------------------------------------------------------------ */
+
+BYTE spi_read( void )
+{
+  /* Clock in 8 bits (clocking out a dummy byte) */
+  SPDR = 0x00;
+
+  /* Wait for the transfer to complete */
+  while( (SPSR & BIT(SPIF)) == 0 );
+
+  /* Return data byte */
+  return SPDR;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void spi_write( BYTE byt )
+{
+  BYTE dummy;
+
+  /* Clock out 8 bits */
+  SPDR = byt;
+
+  /* Wait for the transfer to complete */
+  while( (SPSR & BIT(SPIF)) == 0 );
+
+  /* Complete clearing of the SPI interrupt flag */
+  dummy = SPDR;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#else
 
 /* Provide clock signal */
 #define spi_clk()  SET_SCLK(); NOP(); CLEAR_SCLK(); NOP()
@@ -100,3 +166,5 @@ void spi_write( BYTE byt )
 }
 
 /* ------------------------------------------------------------------------ */
+
+#endif /* _HW_SPI_ */
@@ -4,16 +4,28 @@ File   : spi.h
 Descr  : Declarations of (software) SPI serial interface functions.
 
 History: 19JAN.00; Henk B&B; Definition.
+         16OCT.26; agent; Added hardware SPI functions.
 --------------------------------------------------------------------------- */
 
 #ifndef SPI_H
 #define SPI_H
 
+#ifdef _HW_SPI_
+/* SPI Control Register setting: SPI enabled, Master, MSB first,
+   mode 0 (CPOL=0, CPHA=0), SCK frequency CK/4 (1 MHz @4MHz) */
+#define SPI_SPCR_SETTING  (BIT(SPE) | BIT(MSTR))
+#endif /* _HW_SPI_ */
+
 /* ------------------------------------------------------------------------ */
 /* Function prototypes */
 
-BYTE spi_read ( void );
-void spi_write( BYTE byt );
+BYTE spi_read   ( void );
+void spi_write  ( BYTE byt );
+
+#ifdef _HW_SPI_
+void spi_init   ( void );
+void spi_disable( void );
+#endif /* _HW_SPI_ */
 
 #endif /* SPI_H */
 /* ------------------------------------------------------------------------ */
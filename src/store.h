@@ -11,6 +11,9 @@ History: 21SEP.00; Henk B&B; Definition.
 	 24JUL.01;  "    " ; Go from WORD to BYTE addresses, which is alright
 	                     upto 256 bytes of EEPROM storage...
 	 31OCT.01;  "    " ; Don't use EEPROM address 0.
+	 16OCT.26; agent; Added EE_CAN_BUSOFF_BACKOFF.
+	 16OCT.26; agent; Added EE_CAN_SYNC_EMG_THRESHOLD.
+	 16OCT.26; agent; Added EE_CAN_BAUDRATE_SEL.
 --------------------------------------------------------------------------- */
 
 #ifndef STORE_H
@@ -70,6 +73,9 @@ History: 21SEP.00; Henk B&B; Definition.
 #define EE_RTR_DISABLED                 (STORE_VAR_ADDR + 0x03)
 #define EE_CANOPEN_OPSTATE_INIT         (STORE_VAR_ADDR + 0x04)
 #define EE_CAN_BUSOFF_MAXCNT            (STORE_VAR_ADDR + 0x05)
+#define EE_CAN_BUSOFF_BACKOFF           (STORE_VAR_ADDR + 0x06)
+#define EE_CAN_SYNC_EMG_THRESHOLD       (STORE_VAR_ADDR + 0x07)
+#define EE_CAN_BAUDRATE_SEL             (STORE_VAR_ADDR + 0x0A)
 
 /* Guarding stuff */
 #define EE_LIFETIMEFACTOR               (STORE_VAR_ADDR + 0x08)
@@ -6,15 +6,19 @@ Descr  : ATMEL AVR microcontroller Timer/Counter1 routines.
 History: 20JUL.00; Henk B&B; Version for ELMB Master processor.
          16OCT.01; Henk B&B; Remove Master/Slave monitor mechanism from
 	                     interrupt routine.
+	 16OCT.26; agent; Provide the seconds count for the CAN traffic
+			  share (compile option _CAN_TRAFFIC_).
 --------------------------------------------------------------------------- */
 
 #include "general.h"
+#include "can.h"
 #include "guarding.h"
 #include "pdo.h"
 #include "timer1XX.h"
 #include "watchdog.h"
 
 extern BYTE CanBusOffCnt;
+extern BYTE CanBusOffQuiet;
 
 /* ------------------------------------------------------------------------ */
 
@@ -59,7 +63,8 @@ void timer1ovf_handler( void )
      - periodic PDO transmissions
      - Lifeguarding
      - Heartbeat
-     - Busoff retry counter */
+     - Busoff retry counter
+     - CAN traffic share window */
 
   {
     BYTE pdo_no;
@@ -72,6 +77,12 @@ void timer1ovf_handler( void )
   ++HeartBeatCntr;
 
   if( CanBusOffCnt ) --CanBusOffCnt;
+  if( CanBusOffQuiet ) --CanBusOffQuiet;
+
+#ifdef _CAN_TRAFFIC_
+  /* Time base for the CAN traffic share sliding window */
+  ++CanTrafficSecs;
+#endif /* _CAN_TRAFFIC_ */
 
   /* Time for the Master to perform the watchdog function */
   KickWatchdog = TRUE;
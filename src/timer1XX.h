@@ -6,6 +6,11 @@ Descr  : Definitions and declarations for ATMEL AVR ATmega1xx microcontroller
 
 History: 16.09.99; Henk B&B; Definitions for AVR micros.
          27APR.00; Henk B&B; Additions/changes to match the ATmega103 micro.
+         16OCT.26; agent; Added Timer3 (ATmega128 only) as a free-running
+			  timebase.
+	 16OCT.26; agent; Added Timer0 client for CAN Bus-off recovery.
+	 16OCT.26; agent; Added Timer0 client for CAN baudrate detection.
+	 16OCT.26; agent; Added Timer0 client for CAN register refresh.
 --------------------------------------------------------------------------- */
 
 #ifndef TIMER1XX_H
@@ -180,11 +185,13 @@ History: 16.09.99; Henk B&B; Definitions for AVR micros.
 #define T0_OVERFLOW_IE   TOIE0
 #define T1_OVERFLOW_IE   TOIE1
 #define T2_OVERFLOW_IE   TOIE2
+#define T3_OVERFLOW_IE   TOIE3 /* (in ETIMSK) */
 
 /* Timer/Counter Interrupt FLAG Register bits */
 #define T0_OVERFLOW      TOV0
 #define T1_OVERFLOW      TOV1
 #define T2_OVERFLOW      TOV2
+#define T3_OVERFLOW      TOV3  /* (in ETIFR) */
 
 /* Timer/Counter0 Control Register clock prescale select */
 #define T0_STOP          0x00
@@ -216,6 +223,17 @@ History: 16.09.99; Henk B&B; Definitions for AVR micros.
 #define T2_FALLING_EDGE  0x06
 #define T2_RISING_EDGE   0x07
 
+/* Timer/Counter3 Control Register clock prescale select */
+#define T3_STOP          0x00
+#define T3_CK_DIV_1      0x01
+#define T3_CK_DIV_8      0x02
+#define T3_CK_DIV_64     0x03
+#define T3_CK_DIV_256    0x04
+#define T3_CK_DIV_1024   0x05
+
+/* Timer3 (free-running at CK/64) timebase: microseconds per tick (4 MHz) */
+#define T3_MUS_PER_TICK  16
+
 /* ------------------------------------------------------------------------ */
 /* Timer1 stuff */
 
@@ -233,10 +251,13 @@ History: 16.09.99; Henk B&B; Definitions for AVR micros.
 #define SET_TIMER0_10MS()   {TCNT0=217; TCCR0=T0_CK_DIV_1024;}
 
 /* Number of clients for time-out services */
-#define T0_CLIENTS          1
+#define T0_CLIENTS          4
 
 /* Client identifiers */
 #define ADC_ELMB            0
+#define CAN_BUSOFF          1
+#define CAN_AUTOBAUD        2
+#define CAN_REFRESH         3
 
 /* ------------------------------------------------------------------------ */
 /* Function prototypes */
@@ -255,5 +276,11 @@ void timer0_init            ( void );
 void timer0_set_timeout_10ms( BYTE client, BYTE ticks );
 BOOL timer0_timeout         ( BYTE client );
 
+#ifndef _ELMB103_
+/* Timer3 is a free-running timebase for time measurements */
+void   timer3_init          ( void );
+UINT16 timer3_read          ( void );
+#endif /* _ELMB103_ */
+
 #endif /* TIMER1XX_H */
 /* ------------------------------------------------------------------------ */
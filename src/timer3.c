@@ -0,0 +1,65 @@
+/* ------------------------------------------------------------------------
+File   : timer3.c
+
+Descr  : ATMEL AVR microcontroller Timer/Counter3 routines.
+
+History: 16OCT.26; agent; Timer3 used as a free-running timebase
+			  for time measurements (ATmega128 only).
+--------------------------------------------------------------------------- */
+
+#include "general.h"
+#include "timer1XX.h"
+
+#ifndef _ELMB103_
+
+/* ------------------------------------------------------------------------ */
+
+void timer3_init( void )
+{
+  /* Initialize Timer3 as a free-running 16-bit counter,
+     with a 'clocktick' of 16 microseconds (4 MHz, CK/64),
+     so it overflows (wraps around) every 1.049 s;
+     no interrupts are used */
+
+  /* Stop the timer */
+  TCCR3B = T3_STOP;
+
+  /* Normal mode, no output compare pins */
+  TCCR3A = 0x00;
+
+  /* Disable Timer3 overflow interrupt */
+  ETIMSK &= ~BIT( T3_OVERFLOW_IE );
+
+  /* Start counting from zero (write high byte first!) */
+  TCNT3H = 0x00;
+  TCNT3L = 0x00;
+
+  /* Clear the timer overflow flag, by writing a 1 ! */
+  ETIFR = BIT( T3_OVERFLOW );
+
+  /* Start the timer */
+  TCCR3B = T3_CK_DIV_64;
+}
+
+/* ------------------------------------------------------------------------ */
+
+UINT16 timer3_read( void )
+{
+  BYTE lo, hi, sreg;
+
+  /* The 16-bit counter value must be read low byte first (the high byte
+     is latched in a temporary register at the same time), so make sure
+     no interrupt routine gets in between; may be called from
+     interrupt routines too, so restore the interrupt state afterwards */
+  sreg = SREG;
+  CLI();
+  lo = TCNT3L;
+  hi = TCNT3H;
+  SREG = sreg;
+
+  return( ((UINT16) hi << 8) | (UINT16) lo );
+}
+
+/* ------------------------------------------------------------------------ */
+
+#endif /* _ELMB103_ */